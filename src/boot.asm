@@ -6,6 +6,12 @@ MB_CHECKSUM equ -(MB_MAGIC + MB_FLAGS)
 
 VIRT_OFFSET equ 0xc0000000
 
+%ifdef CONFIG_PAE
+PTE_SIZE equ 8
+%else
+PTE_SIZE equ 4
+%endif
+
 section .multiboot
     dd MB_MAGIC
     dd MB_FLAGS
@@ -15,6 +21,22 @@ section .bss
 stack_bottom:   resb 16384
 stack_top:
 
+%ifdef CONFIG_PAE
+; PAE tables only have 512 entries each. The four page directories are kept
+; back to back so virt.c can treat them as one flat array, and two page
+; tables cover the same 4MiB a single one does without PAE.
+global init_pd
+align 4096
+init_pd:        resb 4 * 4096
+
+global init_pt
+align 4096
+init_pt:        resb 2 * 4096
+
+global init_pdpt
+align 32
+init_pdpt:      resb 32
+%else
 global init_pd
 align 4096
 init_pd:        resb 4096
@@ -22,6 +44,7 @@ init_pd:        resb 4096
 global init_pt
 align 4096
 init_pt:        resb 4096
+%endif
 
 ; pain and suffering.
 global mb_info_pt
@@ -51,6 +74,14 @@ _start:
     mov dword [mb_checksum - VIRT_OFFSET], eax
     mov dword [mb_info - VIRT_OFFSET], ebx
 
+%ifdef CONFIG_PAE
+    ; no point in going on if the cpu can't do PAE
+    mov eax, 1
+    cpuid
+    test edx, 1 << 6
+    jz .no_pae
+%endif
+
     mov eax, init_pt - VIRT_OFFSET
     mov ebx, 0
 
@@ -62,20 +93,37 @@ _start:
 ;     or edx, 2 ; P_WRITABLE
 ; .not_writable:
     mov dword [eax], edx
-    add eax, 4
+    add eax, PTE_SIZE
     add ebx, 4096
     cmp ebx, _kernel_end - VIRT_OFFSET
     jl .map_high
 
     ; map the vga mem onto itself. luckily, it fits into one page :)
     ; and since we're loaded at 1M, it doesn't clash with the kernel mapping either.
-    mov dword [init_pt - VIRT_OFFSET + 0xb8], 0xb8000 | 0x3
+    mov dword [init_pt - VIRT_OFFSET + 0xb8 * PTE_SIZE], 0xb8000 | 0x3
 
     ; identity map the kernel
     mov eax, init_pt - VIRT_OFFSET  ; can't do `|` on addresses
     or eax, 3                       ; P_PRESENT | P_WRITABLE
     mov dword [init_pd - VIRT_OFFSET], eax
 
+%ifdef CONFIG_PAE
+    ; and add the higher half mapping. with PAE, a pd entry only covers 2MiB,
+    ; so we need the second page table as well.
+    mov dword [init_pd - VIRT_OFFSET + (0xc0000000 >> 21) * 8], eax
+    add eax, 4096
+    mov dword [init_pd - VIRT_OFFSET + 8], eax
+    mov dword [init_pd - VIRT_OFFSET + ((0xc0000000 >> 21) + 1) * 8], eax
+
+    ; the last four entries of the last pd point to the four pds,
+    ; and the pdpt points to them as well (present is the only allowed flag there)
+%assign i 0
+%rep 4
+    mov dword [init_pd - VIRT_OFFSET + (2044 + i) * 8], init_pd - VIRT_OFFSET + i * 4096 + 3
+    mov dword [init_pdpt - VIRT_OFFSET + i * 8], init_pd - VIRT_OFFSET + i * 4096 + 1
+%assign i i+1
+%endrep
+%else
     ; and add the higher half mapping
     VIRT_PD_OFFSET equ 0xc0000000 / 4096 / 1024 * 4
     mov dword [init_pd - VIRT_OFFSET + 768 * 4], eax
@@ -84,6 +132,7 @@ _start:
     mov eax, init_pd - VIRT_OFFSET
     or eax, 3
     mov dword [init_pd - VIRT_OFFSET + 4092], eax
+%endif
 
     ; map multiboot struct
     mov ecx, dword [mb_info - VIRT_OFFSET]
@@ -92,16 +141,24 @@ _start:
     shr ecx, 22
     jz .same_pt_as_the_rest
 
+%ifdef CONFIG_PAE
+    ; pd index (the pds are one flat array) and pt index
+    mov ecx, eax
+    shr ecx, 21
+    shr eax, 12
+    and eax, 0x1ff
+%else
     ; pt index
     shr eax, 12
     and eax, 0x3ff
+%endif
     ; pt entry
     and ebx, ~0xfff
     or ebx, 3
-    mov dword [mb_info_pt - VIRT_OFFSET + eax * 4], ebx
+    mov dword [mb_info_pt - VIRT_OFFSET + eax * PTE_SIZE], ebx
 
     ; put mb mapping into pd
-    mov dword [init_pd - VIRT_OFFSET + ecx * 4], (mb_info_pt - VIRT_OFFSET + 3)
+    mov dword [init_pd - VIRT_OFFSET + ecx * PTE_SIZE], (mb_info_pt - VIRT_OFFSET + 3)
     jmp .virt_setup_done
 
 .same_pt_as_the_rest:
@@ -111,11 +168,19 @@ _start:
     ; pt entry
     and ebx, ~0xfff
     or ebx, 3
-    mov dword [init_pt - VIRT_OFFSET + eax * 4], ebx
+    mov dword [init_pt - VIRT_OFFSET + eax * PTE_SIZE], ebx
 
 .virt_setup_done:
+%ifdef CONFIG_PAE
+    ; set the pdpt and enable paging
+    mov eax, cr4
+    or eax, 1 << 5 ; PAE = 1
+    mov cr4, eax
+    mov eax, init_pdpt - VIRT_OFFSET
+%else
     ; set the pd and enable paging
     mov eax, init_pd - VIRT_OFFSET
+%endif
     mov cr3, eax
     mov eax, cr0
     or eax, 0x80010000 ; PG = 1, WP = 1
@@ -130,6 +195,17 @@ _start:
 
     jmp real_start
 
+%ifdef CONFIG_PAE
+.no_pae:
+    ; paging is still off, so the vga buffer is just where it always is
+    mov dword [0xb8000], 0x4f414f50 ; "PA"
+    mov dword [0xb8004], 0x4f214f45 ; "E!"
+    cli
+.no_pae_hang:
+    hlt
+    jmp .no_pae_hang
+%endif
+
 section .text
 global real_start
 real_start:
@@ -150,3 +226,10 @@ outb:
     mov dx, word [esp + 4]
     out dx, al
     ret
+
+global inb
+inb:
+    mov dx, word [esp + 4]
+    xor eax, eax
+    in al, dx
+    ret
@@ -171,6 +171,11 @@ typedef struct __attribute__((packed)) elf_rela_t {
 #define PT_LOPROC 0x70000000
 #define PT_HIPROC 0x7fffffff
 
+// Program header flags
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
 typedef struct __attribute__((packed)) elf_program_header_t {
     uint32_t type;
     uint32_t offset;
@@ -0,0 +1,192 @@
+#include "shm.h"
+
+#include "../io/vga.h"
+#include "../mem/phys.h"
+#include "../mem/slab.h"
+#include "../misc.h"
+
+// Shared frames stay allocated for as long as anyone has them mapped, so nobody gets to
+// pin an unlimited amount of them.
+#define SHM_MAX_REGION_PAGES 4096
+#define SHM_MAX_OWNER_PAGES  16384
+
+typedef struct shm_grant_t {
+    uint32_t pid;
+    uint32_t rights;
+    struct shm_grant_t *next;
+} shm_grant_t;
+
+typedef struct shm_t {
+    uint32_t id;
+    uint32_t owner;
+    uint32_t page_count;
+    phys_addr_t *frames;    // vmalloc'd, one per page. Holds a reference on each of them.
+    shm_grant_t *grants;
+    struct shm_t *next;
+} shm_t;
+
+static kmem_cache_t *shm_cache = NULL;
+static kmem_cache_t *grant_cache = NULL;
+static shm_t *regions = NULL;
+static uint32_t next_id = 0;
+
+static shm_t *find(uint32_t id) {
+    for (shm_t *shm = regions; shm != NULL; shm = shm->next) {
+        if (shm->id == id) return shm;
+    }
+
+    return NULL;
+}
+
+static uint32_t owned_pages(uint32_t owner) {
+    uint32_t count = 0;
+    for (shm_t *shm = regions; shm != NULL; shm = shm->next) {
+        if (shm->owner == owner) count += shm->page_count;
+    }
+
+    return count;
+}
+
+static void free_frames(phys_addr_t *frames, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        phys_unref(frames[i]);
+    }
+}
+
+static void destroy(shm_t *shm) {
+    free_frames(shm->frames, shm->page_count);
+    vfree(shm->frames, shm->page_count * sizeof(phys_addr_t));
+
+    while (shm->grants != NULL) {
+        shm_grant_t *grant = shm->grants;
+        shm->grants = grant->next;
+        kmem_cache_free(grant_cache, grant);
+    }
+
+    kmem_cache_free(shm_cache, shm);
+}
+
+void shm_init() {
+    shm_cache = kmem_cache_create("shm_t", sizeof(shm_t));
+    grant_cache = kmem_cache_create("shm_grant_t", sizeof(shm_grant_t));
+    if (shm_cache == NULL || grant_cache == NULL) panic("shm.c: Couldn't create the caches!\n");
+}
+
+uint32_t shm_create(uint32_t owner, uint32_t size) {
+    // Checking the size before rounding it up also keeps the rounding from wrapping around.
+    if (size == 0 || size > SHM_MAX_REGION_PAGES * PAGE_SIZE) return SHM_INVALID;
+    uint32_t count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (owned_pages(owner) + count > SHM_MAX_OWNER_PAGES) return SHM_INVALID;
+
+    shm_t *shm = kmem_cache_alloc(shm_cache);
+    if (shm == NULL) return SHM_INVALID;
+
+    shm->frames = vmalloc(count * sizeof(phys_addr_t));
+    if (shm->frames == NULL) {
+        kmem_cache_free(shm_cache, shm);
+        return SHM_INVALID;
+    }
+
+    // Contiguous chunks are preferred, they map in fewer runs. Anything will do, though.
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run = count - i;
+        if (run > LARGE_PAGE_SIZE / PAGE_SIZE) run = LARGE_PAGE_SIZE / PAGE_SIZE;
+
+        phys_addr_t phys = phys_alloc_range(run * PAGE_SIZE);
+        if (phys == 0) {
+            run = 1;
+            phys = phys_alloc();
+        }
+
+        if (phys == 0) {
+            free_frames(shm->frames, i);
+            vfree(shm->frames, count * sizeof(phys_addr_t));
+            kmem_cache_free(shm_cache, shm);
+            return SHM_INVALID;
+        }
+
+        for (uint32_t j = 0; j < run; j++, i++) {
+            shm->frames[i] = phys + j * PAGE_SIZE;
+
+            // Whoever had these frames before shouldn't get to tell the next one anything.
+            void *page = virt_kmap(shm->frames[i]);
+            memset(page, 0, PAGE_SIZE);
+            virt_kunmap(page);
+        }
+    }
+
+    shm->id = next_id++;
+    shm->owner = owner;
+    shm->page_count = count;
+    shm->grants = NULL;
+    shm->next = regions;
+    regions = shm;
+    return shm->id;
+}
+
+int shm_grant(uint32_t id, uint32_t owner, uint32_t pid, uint32_t rights) {
+    shm_t *shm = find(id);
+    if (shm == NULL || shm->owner != owner) return -1;
+    if ((rights & ~(SHM_READ | SHM_WRITE)) != 0) return -1;
+
+    for (shm_grant_t *grant = shm->grants; grant != NULL; grant = grant->next) {
+        if (grant->pid != pid) continue;
+
+        grant->rights = rights;
+        return 0;
+    }
+
+    shm_grant_t *grant = kmem_cache_alloc(grant_cache);
+    if (grant == NULL) return -1;
+
+    grant->pid = pid;
+    grant->rights = rights;
+    grant->next = shm->grants;
+    shm->grants = grant;
+    return 0;
+}
+
+void *shm_map(uint32_t id, uint32_t pid, vmm_ctx_t *ctx) {
+    shm_t *shm = find(id);
+    if (shm == NULL) return NULL;
+
+    uint32_t rights = 0;
+    if (shm->owner == pid) {
+        rights = SHM_READ | SHM_WRITE;
+    } else {
+        for (shm_grant_t *grant = shm->grants; grant != NULL; grant = grant->next) {
+            if (grant->pid == pid) rights = grant->rights;
+        }
+    }
+
+    // x86 can't map something write-only, so write implies read.
+    if (rights == 0) return NULL;
+    return virt_map_shared(ctx, shm->frames, shm->page_count, (rights & SHM_WRITE) != 0);
+}
+
+void shm_release(uint32_t owner) {
+    shm_t **link = &regions;
+    while (*link != NULL) {
+        shm_t *shm = *link;
+        if (shm->owner == owner) {
+            *link = shm->next;
+            destroy(shm);
+            continue;
+        }
+
+        // PIDs get reused, whoever gets this one next mustn't inherit what it was granted.
+        shm_grant_t **grant_link = &shm->grants;
+        while (*grant_link != NULL) {
+            shm_grant_t *grant = *grant_link;
+            if (grant->pid != owner) {
+                grant_link = &grant->next;
+                continue;
+            }
+
+            *grant_link = grant->next;
+            kmem_cache_free(grant_cache, grant);
+        }
+
+        link = &shm->next;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+
+#include "../mem/virt.h"
+
+// Rights a process can be granted on a shared region.
+#define SHM_READ    0x01
+#define SHM_WRITE   0x02
+
+#define SHM_INVALID ((uint32_t) -1)
+
+void shm_init();
+
+// Makes a zeroed shared region of `size` bytes. The owner can map it read/write and grant
+// it to others. Regions and what one owner has in total are capped. Returns its ID, or
+// SHM_INVALID.
+uint32_t shm_create(uint32_t owner, uint32_t size);
+// Lets `pid` map the region with the given SHM_* rights. Only the owner can do that,
+// and granting again replaces the old rights. Returns 0 on success, -1 otherwise.
+int shm_grant(uint32_t id, uint32_t owner, uint32_t pid, uint32_t rights);
+// Maps the region into ctx, which belongs to pid. Every process that maps it sees the
+// same frames. Returns the address, or NULL if pid wasn't granted anything.
+void *shm_map(uint32_t id, uint32_t pid, vmm_ctx_t *ctx);
+// Drops all regions pid owns, and everything it was granted. Their frames stay around for
+// as long as they're mapped.
+void shm_release(uint32_t owner);
+
+#endif
@@ -1,12 +1,18 @@
 #include "io/vga.h"
+#include "ipc/shm.h"
 #include "mem/phys.h"
+#include "mem/slab.h"
 #include "mem/virt.h"
 #include "misc.h"
 #include "multiboot.h"
 #include "proc/proc.h"
+#include "proc/work.h"
 #include "timer/timer.h"
+#include "x86/fpu.h"
 #include "x86/gdt.h"
 #include "x86/idt.h"
+#include "x86/smp.h"
+#include "x86/spinlock.h"
 
 extern void enable_interrupts(); // idt.asm
 
@@ -22,16 +28,25 @@ void main(mb_info_t *mb_info, uint32_t mb_checksum) {
               mb_checksum);
     }
 
-    gdt_load();
+    gdt_load(0);
     idt_load();
+    fpu_init();
     phys_init(mb_info);
     virt_init(mb_info);
-    timer_init(TIMER_PIT, 1);
+    slab_init();
+    shm_init();
+    timer_init(TIMER_PIT);
+    smp_init();
 
     proc_load(mb_info);
+    work_init();
+    slab_print_stats();
+    spinlock_print_stats();
+    vga_printf("CR3 writes during boot: %u\n", virt_get_cr3_writes());
 
     vga_printf("Hi :3\n");
+    smp_release();
     enable_interrupts();
 
-    while (1) {}
+    proc_idle();
 }
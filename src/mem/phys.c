@@ -2,19 +2,74 @@
 
 #include "../io/vga.h"
 #include "../misc.h"
+#include "../x86/spinlock.h"
 #include "virt.h"
 
 extern void *kernel_start;
 extern void *kernel_end;
 
-extern void phys_acquire_lock();
-extern void phys_release_lock();
+// Interrupt handlers allocate too, so it's always taken with interrupts off.
+static spinlock_t phys_lock = SPINLOCK_INIT("phys");
+
+// The frame array lives right after the direct map, see virt.h.
+#define FRAMES_ADDR ((phys_frame_t *) FRAMES_START)
+
+#define FRAME_FREE  0x01 // Set on the first frame of a block in one of the free lists
+#define FRAME_AVAIL 0x02 // Only used above 4GiB, where the bitmap doesn't reach
+
+#define LOW_MEM_LIMIT 0x100000000ll
+
+#ifdef CONFIG_PAE
+// The frame array gets big, so we don't go all the way to PAE's 64GiB.
+# define HIGH_MEM_LIMIT 0x400000000ll
+# define MAX_HIGH_RANGES 16
+# define ZONE_COUNT 2
+#else
+# define ZONE_COUNT 1
+#endif
+
+// Frames above 4GiB get their own free lists, so that things like PDPTs,
+// which have to stay below, can still be served. Without PAE, there is only the low zone.
+#define ZONE_LOW 0
+#define ZONE_OF(index) ((index) >= MAX_PAGES)
+
+// How many zeroed pages the idle loop keeps around.
+#define ZEROED_POOL_SIZE 64
+
+// One of these exists for every physical page up to the highest usable one.
+typedef struct phys_frame_t {
+    struct phys_frame_t *next;
+    struct phys_frame_t *prev;
+    uint8_t order;
+    uint8_t flags;
+    uint16_t refs; // How many mappings share this page, see phys_ref/phys_unref
+} phys_frame_t;
+
+#ifdef CONFIG_PAE
+typedef struct high_range_t {
+    uint32_t first_frame;
+    uint32_t frame_count;
+} high_range_t;
+
+// Memory above 4GiB is never reserved by anything at boot, so we only remember
+// where it is until the frame array exists.
+static high_range_t high_ranges[MAX_HIGH_RANGES];
+static uint32_t high_range_count = 0;
+#endif
 
 static uint32_t mmap[PAGE_ENTRIES];
 static uint32_t usable_pages = 0;
 static uint32_t free_pages = 0;
 
-static volatile int lock = 0;
+static phys_frame_t *frames = NULL;
+static uint32_t frame_count = 0;
+static phys_frame_t *free_lists[ZONE_COUNT][PHYS_MAX_ORDER + 1];
+
+static phys_frame_t *zeroed_pages = NULL;
+static uint32_t zeroed_count = 0;
+
+// A page below 1MiB, where APs can start in real mode.
+static uint32_t low_page = 0;
 
 static void pretty_print_mmap_entry(const mmap_addr_range_t *entry) {
     uint32_t base_high = entry->base_addr >> 32;
@@ -66,6 +121,35 @@ static int is_range_avail(uint32_t base, uint32_t limit) {
     return 1;
 }
 
+// Same as set_range_avail, but by frame index, so it works above 4GiB too.
+static void set_frames_avail(uint32_t index, uint32_t count, int avail) {
+    for (; count > 0; index++, count--) {
+        if (index < MAX_PAGES) {
+            set_page_avail(index * PAGE_SIZE, avail);
+            continue;
+        }
+
+        phys_frame_t *frame = &frames[index];
+        if (avail && !(frame->flags & FRAME_AVAIL)) free_pages++;
+        if (!avail && (frame->flags & FRAME_AVAIL)) free_pages--;
+
+        if (avail) {
+            frame->flags |= FRAME_AVAIL;
+        } else {
+            frame->flags &= ~FRAME_AVAIL;
+        }
+    }
+}
+
+static int is_frame_avail(uint32_t index) {
+    if (index < MAX_PAGES) return is_page_avail(index * PAGE_SIZE);
+    return frames[index].flags & FRAME_AVAIL;
+}
+
+static uint32_t frame_of(phys_addr_t addr) {
+    return (uint32_t) (addr >> PAGE_SHIFT);
+}
+
 static uint64_t align_to_page(uint64_t addr, int round_down) {
     // Align to page boundary
     if (round_down) {
@@ -88,6 +172,171 @@ static uint32_t round_up_page(uint32_t addr) {
     return align_to_page(addr, 0);
 }
 
+// Only used while setting up the frame array, before the free lists exist.
+// Returns 0 on failure, since page 0 is never available.
+static uint32_t boot_alloc_range(uint32_t size) {
+    uint32_t aligned_length = round_up_page(size);
+
+    for (uint64_t addr = PAGE_SIZE; addr + aligned_length <= 0xffffffff; addr += PAGE_SIZE) {
+        if (!is_range_avail(addr, addr + aligned_length)) continue;
+
+        set_range_avail(addr, addr + aligned_length, 0);
+        return addr;
+    }
+
+    return 0;
+}
+
+static void free_list_push(phys_frame_t *frame, uint32_t order) {
+    phys_frame_t **list = &free_lists[ZONE_OF(frame - frames)][order];
+
+    frame->order = order;
+    frame->flags |= FRAME_FREE;
+    frame->prev = NULL;
+    frame->next = *list;
+
+    if (frame->next != NULL) frame->next->prev = frame;
+    *list = frame;
+}
+
+static void free_list_remove(phys_frame_t *frame) {
+    if (frame->prev != NULL) {
+        frame->prev->next = frame->next;
+    } else {
+        free_lists[ZONE_OF(frame - frames)][frame->order] = frame->next;
+    }
+
+    if (frame->next != NULL) frame->next->prev = frame->prev;
+
+    frame->flags &= ~FRAME_FREE;
+    frame->next = NULL;
+    frame->prev = NULL;
+}
+
+// Puts a naturally aligned block back, merging it with its buddy as long as possible.
+// Blocks never grow past 4MiB, so they can't end up straddling the 4GiB line.
+static void buddy_free_block(uint32_t index, uint32_t order) {
+    while (order < PHYS_MAX_ORDER) {
+        uint32_t buddy_index = index ^ (1 << order);
+        if (buddy_index >= frame_count) break;
+
+        phys_frame_t *buddy = &frames[buddy_index];
+        if (!(buddy->flags & FRAME_FREE) || buddy->order != order) break;
+
+        free_list_remove(buddy);
+        index &= ~(1 << order);
+        order++;
+    }
+
+    free_list_push(&frames[index], order);
+}
+
+// The range doesn't need to be a block, we just split it into the biggest aligned ones we can.
+static void buddy_free_range(uint32_t index, uint32_t count) {
+    while (count > 0) {
+        uint32_t order = 0;
+        while (order < PHYS_MAX_ORDER
+               && (index & ((2 << order) - 1)) == 0
+               && (2u << order) <= count) {
+            order++;
+        }
+
+        buddy_free_block(index, order);
+        index += 1 << order;
+        count -= 1 << order;
+    }
+}
+
+// Returns the index of the first frame, or 0 if there's no block big enough.
+static uint32_t buddy_alloc_block(uint32_t order, int zone) {
+    uint32_t found = order;
+    while (found <= PHYS_MAX_ORDER && free_lists[zone][found] == NULL) found++;
+    if (found > PHYS_MAX_ORDER) return 0;
+
+    phys_frame_t *frame = free_lists[zone][found];
+    free_list_remove(frame);
+    uint32_t index = frame - frames;
+
+    // Split off the upper halves until we're at the size we wanted.
+    while (found > order) {
+        found--;
+        free_list_push(&frames[index + (1 << found)], found);
+    }
+
+    return index;
+}
+
+static uint32_t order_for_pages(uint32_t pages) {
+    uint32_t order = 0;
+    while ((1u << order) < pages) order++;
+    return order;
+}
+
+#ifdef CONFIG_PAE
+static void add_high_range(uint64_t base, uint64_t limit) {
+    if (base < LOW_MEM_LIMIT) base = LOW_MEM_LIMIT;
+    if (limit > HIGH_MEM_LIMIT) {
+        vga_printf("Skipping memory over %d GiB\n", (uint32_t) (HIGH_MEM_LIMIT >> 30));
+        limit = HIGH_MEM_LIMIT;
+    }
+
+    if (base >= limit) return;
+
+    if (high_range_count == MAX_HIGH_RANGES) {
+        vga_printf("Too many memory ranges over 4GiB, skipping one\n");
+        return;
+    }
+
+    high_ranges[high_range_count++] = (high_range_t) {
+        .first_frame = frame_of(base),
+        .frame_count = frame_of(limit - base),
+    };
+}
+#endif
+
+static void init_frames(uint64_t highest_addr) {
+    frame_count = frame_of(highest_addr);
+
+    uint32_t size = round_up_page(frame_count * sizeof(phys_frame_t));
+    if (size > FRAMES_MAX_SIZE) panic("phys.c: The frame array doesn't fit! (%d KiB)\n", size / 1024);
+    uint32_t frames_phys = boot_alloc_range(size);
+    if (frames_phys == 0) panic("phys.c: Couldn't find %d KiB for the frame array!\n", size / 1024);
+
+    // This may need new page tables, which come from boot_alloc_range as long as frames is NULL.
+    virt_mmap_kernel(frames_phys, FRAMES_ADDR, size);
+    memset(FRAMES_ADDR, 0, size);
+    frames = FRAMES_ADDR;
+
+    uint32_t low_count = frame_count < MAX_PAGES ? frame_count : MAX_PAGES;
+    for (uint32_t index = 1; index < low_count; index++) {
+        if (!is_page_avail(index * PAGE_SIZE)) continue;
+
+        uint32_t start = index;
+        while (index < low_count && is_page_avail(index * PAGE_SIZE)) index++;
+        buddy_free_range(start, index - start);
+    }
+
+#ifdef CONFIG_PAE
+    for (uint32_t i = 0; i < high_range_count; i++) {
+        high_range_t *range = &high_ranges[i];
+        set_frames_avail(range->first_frame, range->frame_count, 1);
+        buddy_free_range(range->first_frame, range->frame_count);
+        usable_pages += range->frame_count;
+    }
+#endif
+}
+
+static void zero_page(void *page) {
+    uint32_t count = PAGE_SIZE / sizeof(uint32_t);
+    asm volatile ("rep stosl" : "+D" (page), "+c" (count) : "a" (0) : "memory");
+}
+
+static void zero_phys_page(phys_addr_t phys) {
+    void *page = virt_kmap(phys);
+    zero_page(page);
+    virt_kunmap(page);
+}
+
 void phys_print_avail() {
     for (uint32_t addr = PAGE_SIZE; addr != 0; addr += PAGE_SIZE) {
         if (!is_page_avail(addr)) continue;
@@ -96,16 +345,24 @@ void phys_print_avail() {
         while (is_page_avail(addr)) addr += PAGE_SIZE;
         vga_printf("%p - %p\n", start, addr);
     }
+
+#ifdef CONFIG_PAE
+    for (uint32_t i = 0; i < high_range_count; i++) {
+        high_range_t *range = &high_ranges[i];
+        vga_printf("frames %d - %d (over 4GiB)\n", range->first_frame, range->first_frame + range->frame_count);
+    }
+#endif
 }
 
 void phys_init(const mb_info_t *mb_info) {
-    memset(mmap, 0, PAGE_ENTRIES);
+    memset(mmap, 0, sizeof(mmap));
 
     if (!mb_info->flags.mmap) panic("The bootloader didn't provide a memory map!\n");
 
     uint32_t mmap_size = mb_info->mmap.length;
     mmap_addr_range_t *entry = (void *) mb_info->mmap.addr;
     mmap_addr_range_t *end = (mmap_addr_range_t *) ((void *) entry + mmap_size);
+    uint64_t highest_addr = 0;
     while (entry < end) {
         pretty_print_mmap_entry(entry);
 
@@ -113,10 +370,24 @@ void phys_init(const mb_info_t *mb_info) {
         uint64_t base = align_to_page(entry->base_addr, type != AR_AVAILABLE);
         uint64_t limit = align_to_page(base + entry->length, type == AR_AVAILABLE);
 
-        if (limit > 0xffffffffll) {
-            vga_printf("Skipping entry pointing to memory over 4GiB\n");
-        } else if (base != 0ll) {
-            set_range_avail(base, limit, type == AR_AVAILABLE);
+        // An entry can cross 4GiB. Its part below goes in the bitmap, the rest is high memory.
+        uint64_t low_limit = limit < LOW_MEM_LIMIT ? limit : LOW_MEM_LIMIT;
+        if (base != 0ll && base < low_limit) {
+            set_frames_avail(base >> PAGE_SHIFT, (low_limit - base) >> PAGE_SHIFT, type == AR_AVAILABLE);
+        }
+
+        if (limit > LOW_MEM_LIMIT) {
+#ifdef CONFIG_PAE
+            if (type == AR_AVAILABLE) add_high_range(base, limit);
+            if (limit > HIGH_MEM_LIMIT) limit = HIGH_MEM_LIMIT;
+#else
+            vga_printf("Skipping memory over 4GiB\n");
+            limit = base < LOW_MEM_LIMIT ? LOW_MEM_LIMIT : 0;
+#endif
+        }
+
+        if (type == AR_AVAILABLE && limit > highest_addr) {
+            highest_addr = limit;
         }
 
         void *next_entry = (void *) entry + entry->size + sizeof(uint32_t);
@@ -131,6 +402,12 @@ void phys_init(const mb_info_t *mb_info) {
                     align_to_page((uint32_t) kernel_end - 0xc0000000, 0),
                     0);
 
+    // The multiboot structures are still needed by virt_init and proc_load.
+    set_page_avail((uint32_t) mb_info - 0xc0000000, 0);
+    set_range_avail(align_to_page((uint32_t) mb_info->mmap.addr, 1),
+                    (uint32_t) mb_info->mmap.addr + mmap_size,
+                    0);
+
     if (mb_info->flags.mods && mb_info->mods.count > 0) {
         mod_t *modules = mb_info->mods.addr;
         set_page_avail((uint32_t) modules, 0);
@@ -139,68 +416,197 @@ void phys_init(const mb_info_t *mb_info) {
         for (uint32_t i = 0; i < mb_info->mods.count; i++) {
             mod_t *module = &modules[i];
             set_range_avail((uint32_t) module->start, (uint32_t) module->end, 0);
+            if (module->string != NULL) set_page_avail((uint32_t) module->string, 0);
         }
     }
 
-    uint32_t kb_usable = usable_pages * PAGE_SIZE / 1024;
-    uint32_t kb_free = free_pages * PAGE_SIZE / 1024;
-    vga_printf("Max pages: %d, usable: %d KiB, free: %d KiB\n", MAX_PAGES, kb_usable, kb_free);
+    // Taken from the top, the BIOS likes to keep its own things at the bottom.
+    for (uint32_t addr = 0x100000 - PAGE_SIZE; addr >= PAGE_SIZE; addr -= PAGE_SIZE) {
+        if (is_page_avail(addr)) {
+            set_page_avail(addr, 0);
+            low_page = addr;
+            break;
+        }
+    }
+
+    init_frames(highest_addr);
+
+    uint32_t kb_usable = usable_pages * (PAGE_SIZE / 1024);
+    uint32_t kb_free = free_pages * (PAGE_SIZE / 1024);
+    vga_printf("Max pages: %d, usable: %d KiB, free: %d KiB\n", frame_count, kb_usable, kb_free);
     phys_print_avail();
 }
 
+uint64_t phys_get_mem_end() {
+    return (uint64_t) frame_count << PAGE_SHIFT;
+}
+
 uint32_t phys_get_usable_pages() {
     return usable_pages;
 }
 
+// Pages in the zeroed pool are free for anyone to take, so they count too.
 uint32_t phys_get_free_pages() {
-    return free_pages;
+    return free_pages + zeroed_count;
+}
+
+uint32_t phys_get_low_page() {
+    return low_page;
 }
 
-void *phys_alloc() {
+phys_addr_t phys_alloc() {
     return phys_alloc_range(PAGE_SIZE);
 }
 
-void *phys_alloc_range(uint32_t size) {
-    if (size == 0) return NULL;
-    uint32_t aligned_length = round_up_page(size);
+static phys_addr_t alloc_range_in_zones(uint32_t size, int highest_zone) {
+    if (size == 0) return 0;
+    uint32_t pages = round_up_page(size) / PAGE_SIZE;
 
-    while (lock == 1) {}
-    lock = 1;
+    if (frames == NULL) return boot_alloc_range(size);
 
-    uint64_t addr = 0;
-    uint32_t end = 0;
-    int found = 0;
-    while (addr < 0xffffffff) {
-        if (!is_page_avail(addr)) {
-            addr += PAGE_SIZE;
-            continue;
-        }
+    uint32_t order = order_for_pages(pages);
+    if (order > PHYS_MAX_ORDER) return 0;
 
-        end = addr + aligned_length;
-        if (!is_range_avail(addr, end)) {
-            addr += aligned_length;
-            continue;
-        }
+    uint32_t flags = spin_lock_irqsave(&phys_lock);
 
-        found = 1;
-        break;
+    // Prefer high memory, so the low zone is still around for whoever really needs it.
+    uint32_t index = 0;
+    for (int zone = highest_zone; zone >= ZONE_LOW && index == 0; zone--) {
+        index = buddy_alloc_block(order, zone);
     }
 
-    if (!found) return NULL;
-    if (addr > 0xffffffff) return NULL;
+    if (index == 0) {
+        spin_unlock_irqrestore(&phys_lock, flags);
+        return 0;
+    }
+
+    // Give back whatever rounding up to a power of two added.
+    buddy_free_range(index + pages, (1 << order) - pages);
+    set_frames_avail(index, pages, 0);
 
-    set_range_avail(addr, end, 0);
+    for (uint32_t i = 0; i < pages; i++) {
+        frames[index + i].refs = 1;
+    }
 
-    lock = 0;
+    spin_unlock_irqrestore(&phys_lock, flags);
 
     // vga_printf("avail: %d KiB\n", usable_pages * PAGE_SIZE / 1024);
-    return (void *) (uint32_t) addr;
+    return (phys_addr_t) index << PAGE_SHIFT;
 }
 
-void phys_free(void *ptr) {
-    phys_free_range(ptr, PAGE_SIZE);
+phys_addr_t phys_alloc_range(uint32_t size) {
+    return alloc_range_in_zones(size, ZONE_COUNT - 1);
+}
+
+phys_addr_t phys_alloc_range_low(uint32_t size) {
+    return alloc_range_in_zones(size, ZONE_LOW);
+}
+
+phys_addr_t phys_alloc_zeroed() {
+    uint32_t flags = spin_lock_irqsave(&phys_lock);
+
+    phys_frame_t *frame = zeroed_pages;
+    if (frame != NULL) {
+        zeroed_pages = frame->next;
+        frame->next = NULL;
+        zeroed_count--;
+    }
+
+    spin_unlock_irqrestore(&phys_lock, flags);
+
+    if (frame != NULL) return (phys_addr_t) (frame - frames) << PAGE_SHIFT;
+
+    // The idle loop didn't keep up, so we have to do it ourselves.
+    phys_addr_t phys = phys_alloc();
+    if (phys == 0) return 0;
+
+    zero_phys_page(phys);
+    return phys;
+}
+
+int phys_refill_zeroed() {
+    if (zeroed_count >= ZEROED_POOL_SIZE) return 0;
+
+    phys_addr_t phys = phys_alloc();
+    if (phys == 0) return 0;
+
+    zero_phys_page(phys);
+
+    uint32_t flags = spin_lock_irqsave(&phys_lock);
+
+    phys_frame_t *frame = &frames[frame_of(phys)];
+    frame->next = zeroed_pages;
+    zeroed_pages = frame;
+    zeroed_count++;
+
+    spin_unlock_irqrestore(&phys_lock, flags);
+    return 1;
+}
+
+void phys_free(phys_addr_t addr) {
+    phys_free_range(addr, PAGE_SIZE);
+}
+
+void phys_free_range(phys_addr_t addr, uint32_t size) {
+    uint32_t first = frame_of(addr);
+    uint32_t count = round_up_page(size) / PAGE_SIZE;
+
+    uint32_t flags = spin_lock_irqsave(&phys_lock);
+
+    for (uint32_t index = first; index < first + count; index++) {
+        if (!is_frame_avail(index)) continue;
+
+        spin_unlock_irqrestore(&phys_lock, flags);
+        vga_printf("phys.c: WARNING: Tried to free already free memory! (frame %d)\n", index);
+        return;
+    }
+
+    set_frames_avail(first, count, 1);
+
+    for (uint32_t index = first; index < first + count; index++) {
+        frames[index].refs = 0;
+    }
+
+    buddy_free_range(first, count);
+
+    spin_unlock_irqrestore(&phys_lock, flags);
+}
+
+static phys_frame_t *get_frame(phys_addr_t addr) {
+    uint32_t index = frame_of(addr);
+    if (frames == NULL || index >= frame_count) return NULL;
+    return &frames[index];
+}
+
+void phys_ref(phys_addr_t addr) {
+    phys_frame_t *frame = get_frame(addr);
+    if (frame == NULL) return;
+
+    uint32_t flags = spin_lock_irqsave(&phys_lock);
+    frame->refs++;
+    spin_unlock_irqrestore(&phys_lock, flags);
+}
+
+void phys_unref(phys_addr_t addr) {
+    phys_frame_t *frame = get_frame(addr);
+    if (frame == NULL) return;
+
+    uint32_t flags = spin_lock_irqsave(&phys_lock);
+
+    if (frame->refs == 0) {
+        spin_unlock_irqrestore(&phys_lock, flags);
+        vga_printf("phys.c: WARNING: Tried to unref a page nobody owns! (frame %d)\n", frame_of(addr));
+        return;
+    }
+
+    uint32_t refs = --frame->refs;
+    spin_unlock_irqrestore(&phys_lock, flags);
+
+    if (refs == 0) phys_free(addr);
 }
 
-void phys_free_range(void *ptr, uint32_t size) {
-    set_range_avail((uint32_t) ptr, (uint32_t) ptr + size, 1);
+uint32_t phys_get_refs(phys_addr_t addr) {
+    phys_frame_t *frame = get_frame(addr);
+    if (frame == NULL) return 0;
+    return frame->refs;
 }
@@ -5,18 +5,48 @@
 
 
 #define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
 #define PAGES_PER_GiB (1024 * 1024 * 1024 / PAGE_SIZE)
 #define MAX_PAGES (4 * PAGES_PER_GiB)
 #define PAGE_ENTRIES (MAX_PAGES / 32)
 
+// Biggest block the buddy allocator hands out is 2^10 pages, i.e., 4MiB.
+#define PHYS_MAX_ORDER 10
+
+// With PAE, physical addresses don't fit into a pointer anymore.
+#ifdef CONFIG_PAE
+typedef uint64_t phys_addr_t;
+#else
+typedef uint32_t phys_addr_t;
+#endif
+
 void phys_init(const mb_info_t *mb_info);
 
+// Right after the highest usable page. Can be 4GiB even without PAE, hence the 64 bits.
+uint64_t phys_get_mem_end();
 uint32_t phys_get_usable_pages();
 uint32_t phys_get_free_pages();
+// A page below 1MiB that phys_init kept for itself, or 0 if there was none.
+uint32_t phys_get_low_page();
+
+// All of these return 0 on failure, page 0 is never handed out.
+phys_addr_t phys_alloc();
+// Sizes get rounded up to whole pages. Anything over 4MiB fails.
+phys_addr_t phys_alloc_range(uint32_t size);
+// Same as phys_alloc_range, but guaranteed to be below 4GiB.
+phys_addr_t phys_alloc_range_low(uint32_t size);
+// Takes a page from the pool the idle loop keeps zeroed, or zeroes one itself if it's empty.
+phys_addr_t phys_alloc_zeroed();
+// Zeroes one more page for the pool, if it isn't full yet. Meant to be called when there's nothing else to do.
+// Returns 0 once there's nothing left to zero.
+int phys_refill_zeroed();
+void phys_free(phys_addr_t addr);
+void phys_free_range(phys_addr_t addr, uint32_t size);
 
-void *phys_alloc();
-void *phys_alloc_range(uint32_t size);
-void phys_free(void *ptr);
-void phys_free_range(void *ptr, uint32_t size);
+// Pages start out with one reference when allocated. Shared pages (e.g., after a fork)
+// get one more per mapping, and are only freed once the last one is dropped.
+void phys_ref(phys_addr_t addr);
+void phys_unref(phys_addr_t addr);
+uint32_t phys_get_refs(phys_addr_t addr);
 
 #endif
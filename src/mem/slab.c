@@ -0,0 +1,252 @@
+#include "slab.h"
+
+#include "phys.h"
+#include "virt.h"
+#include "../io/vga.h"
+#include "../misc.h"
+
+#define SLAB_SIZE PAGE_SIZE
+#define SLAB_ALIGN 8
+
+#define KMALLOC_MIN_SHIFT 3 // 8 bytes
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+#define ALIGN_UP(n, align) (((n) + (align) - 1) & ~((align) - 1))
+
+// Every slab is one page, starting with this header. That way, the slab (and cache)
+// an object belongs to is just its address rounded down to the page.
+typedef struct slab_t {
+    kmem_cache_t *cache;
+    struct slab_t *prev;
+    struct slab_t *next;
+    void *free;         // Free objects start with a pointer to the next free one
+    uint32_t in_use;
+} slab_t;
+
+#define FIRST_OBJECT_OFFSET ALIGN_UP(sizeof(slab_t), SLAB_ALIGN)
+#define OBJECTS_PER_SLAB(size) ((SLAB_SIZE - FIRST_OBJECT_OFFSET) / (size))
+
+struct kmem_cache_t {
+    const char *name;
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+
+    slab_t *partial;    // Allocations come from here first
+    slab_t *full;
+    slab_t *empty;      // At most one is kept around, so a cache hovering at a slab boundary doesn't thrash
+
+    uint32_t slabs;
+    uint32_t active_objects;
+    uint32_t allocs;
+    uint32_t frees;
+
+    kmem_cache_t *next; // All caches, for the stats
+};
+
+// The cache all the other caches come from. It can't allocate itself, so it's static.
+static kmem_cache_t cache_cache = {
+    .name = "kmem_cache_t",
+    .object_size = ALIGN_UP(sizeof(kmem_cache_t), SLAB_ALIGN),
+    .objects_per_slab = OBJECTS_PER_SLAB(ALIGN_UP(sizeof(kmem_cache_t), SLAB_ALIGN)),
+};
+
+static kmem_cache_t *caches = &cache_cache;
+static kmem_cache_t *kmalloc_caches[KMALLOC_CLASSES];
+
+static const char *KMALLOC_NAMES[KMALLOC_CLASSES] = {
+    "kmalloc-8",
+    "kmalloc-16",
+    "kmalloc-32",
+    "kmalloc-64",
+    "kmalloc-128",
+    "kmalloc-256",
+    "kmalloc-512",
+    "kmalloc-1024",
+};
+
+static void list_push(slab_t **list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void list_remove(slab_t **list, slab_t *slab) {
+    if (slab->prev != NULL) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static slab_t *new_slab(kmem_cache_t *cache) {
+    slab_t *slab = virt_alloc_kernel();
+    if (slab == NULL) return NULL;
+
+    slab->cache = cache;
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->in_use = 0;
+
+    // Thread the free list through the objects, front to back.
+    void *first = (void *) slab + FIRST_OBJECT_OFFSET;
+    slab->free = first;
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        void **obj = first + i * cache->object_size;
+        *obj = i + 1 < cache->objects_per_slab ? (void *) obj + cache->object_size : NULL;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+static void free_slab(kmem_cache_t *cache, slab_t *slab) {
+    cache->slabs--;
+    virt_free_kernel(slab);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size) {
+    if (size == 0) return NULL;
+
+    // Free objects have to fit the free list pointer.
+    size = ALIGN_UP(size < sizeof(void *) ? sizeof(void *) : size, SLAB_ALIGN);
+    if (OBJECTS_PER_SLAB(size) == 0) {
+        vga_printf("slab.c: WARNING: Objects of %d bytes don't fit into a slab! (%s)\n", size, name);
+        return NULL;
+    }
+
+    kmem_cache_t *cache = kmem_cache_alloc_zeroed(&cache_cache);
+    if (cache == NULL) return NULL;
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->objects_per_slab = OBJECTS_PER_SLAB(size);
+
+    cache->next = caches;
+    caches = cache;
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    slab_t *slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab != NULL) {
+            cache->empty = NULL;
+        } else {
+            slab = new_slab(cache);
+            if (slab == NULL) return NULL;
+        }
+
+        list_push(&cache->partial, slab);
+    }
+
+    void **obj = slab->free;
+    slab->free = *obj;
+    slab->in_use++;
+
+    if (slab->in_use == cache->objects_per_slab) {
+        list_remove(&cache->partial, slab);
+        list_push(&cache->full, slab);
+    }
+
+    cache->active_objects++;
+    cache->allocs++;
+    return obj;
+}
+
+void *kmem_cache_alloc_zeroed(kmem_cache_t *cache) {
+    void *obj = kmem_cache_alloc(cache);
+    if (obj != NULL) memset(obj, 0, cache->object_size);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    slab_t *slab = (slab_t *) ((uint32_t) obj & ~(SLAB_SIZE - 1));
+    if (slab->cache != cache) {
+        panic("slab.c: Tried to free %p into %s, but it belongs to %s!\n",
+              obj, cache->name, slab->cache->name);
+    }
+
+    if (slab->in_use == cache->objects_per_slab) {
+        list_remove(&cache->full, slab);
+        list_push(&cache->partial, slab);
+    }
+
+    *(void **) obj = slab->free;
+    slab->free = obj;
+    slab->in_use--;
+
+    cache->active_objects--;
+    cache->frees++;
+
+    if (slab->in_use > 0) return;
+
+    list_remove(&cache->partial, slab);
+    if (cache->empty == NULL) {
+        cache->empty = slab;
+    } else {
+        free_slab(cache, slab);
+    }
+}
+
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats) {
+    *stats = (kmem_cache_stats_t) {
+        .object_size = cache->object_size,
+        .objects_per_slab = cache->objects_per_slab,
+        .slabs = cache->slabs,
+        .active_objects = cache->active_objects,
+        .total_objects = cache->slabs * cache->objects_per_slab,
+        .allocs = cache->allocs,
+        .frees = cache->frees,
+    };
+}
+
+void slab_init() {
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(KMALLOC_NAMES[i], 1 << (i + KMALLOC_MIN_SHIFT));
+        if (kmalloc_caches[i] == NULL) panic("slab.c: Couldn't create %s!\n", KMALLOC_NAMES[i]);
+    }
+}
+
+void *kmalloc(uint32_t size) {
+    if (size == 0) return NULL;
+    if (size > KMALLOC_MAX) {
+        vga_printf("slab.c: WARNING: kmalloc of %d bytes is too big!\n", size);
+        return NULL;
+    }
+
+    int class = 0;
+    while ((1u << (class + KMALLOC_MIN_SHIFT)) < size) class++;
+    return kmem_cache_alloc(kmalloc_caches[class]);
+}
+
+void *kmalloc_zeroed(uint32_t size) {
+    void *ptr = kmalloc(size);
+    if (ptr != NULL) memset(ptr, 0, size);
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (ptr == NULL) return;
+
+    slab_t *slab = (slab_t *) ((uint32_t) ptr & ~(SLAB_SIZE - 1));
+    kmem_cache_free(slab->cache, ptr);
+}
+
+void slab_print_stats() {
+    vga_printf("slab caches (name: active/total objects of n bytes, slabs):\n");
+    for (kmem_cache_t *cache = caches; cache != NULL; cache = cache->next) {
+        if (cache->slabs == 0) continue;
+
+        uint32_t total = cache->slabs * cache->objects_per_slab;
+        vga_printf("  %s: %d/%d of %d, %d slabs (%d%% used)\n",
+                   cache->name,
+                   cache->active_objects,
+                   total,
+                   cache->object_size,
+                   cache->slabs,
+                   cache->active_objects * 100 / total);
+    }
+}
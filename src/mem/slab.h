@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+
+// Biggest size kmalloc serves. Anything bigger should get whole pages instead.
+#define KMALLOC_MAX 1024
+
+typedef struct kmem_cache_t kmem_cache_t;
+
+typedef struct kmem_cache_stats_t {
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    uint32_t slabs;
+    uint32_t active_objects;    // Handed out right now
+    uint32_t total_objects;     // Room in all slabs, used or not
+    uint32_t allocs;
+    uint32_t frees;
+} kmem_cache_stats_t;
+
+// Sets up the kmalloc size classes. Needs virt_init to have run.
+void slab_init();
+
+// Caches live forever, so there's no kmem_cache_destroy.
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size);
+// Both return NULL when there's no memory left.
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void *kmem_cache_alloc_zeroed(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats);
+
+// Rounds up to the next power of two, at least 8 bytes. Fails for sizes over KMALLOC_MAX.
+void *kmalloc(uint32_t size);
+void *kmalloc_zeroed(uint32_t size);
+// Works for objects from kmem_cache_alloc too. NULL is ignored.
+void kfree(void *ptr);
+
+void slab_print_stats();
+
+#endif
@@ -3,20 +3,47 @@
 #include <stdint.h>
 
 #include "phys.h"
+#include "slab.h"
+#include "vregion.h"
+#include "vrange.h"
 #include "../misc.h"
 #include "../io/vga.h"
+#include "../x86/cpu.h"
+#include "../x86/smp.h"
+#include "../x86/spinlock.h"
 
-#define P_ADDR_MASK     0xfffff000
+// Both paging modes are handled the same way: through the recursive mapping, all page
+// directories show up as one flat array at PD_ADDR, and all page tables as one flat
+// array of PTEs at PT_ADDR. With PAE, that's because the last four entries of the
+// last page directory point at the four page directories.
+#ifdef CONFIG_PAE
+# define P_ADDR_MASK    0x000ffffffffff000ull
+# define PT_ENTRIES     512
+# define PD_SHIFT       21
+# define PD_COUNT       4
+# define PD_ADDR        ((volatile pte_t *) 0xffffc000)
+# define PT_ADDR        ((volatile pte_t *) 0xff800000)
+#else
+# define P_ADDR_MASK    0xfffff000
+# define PT_ENTRIES     1024
+# define PD_SHIFT       22
+# define PD_COUNT       1
+# define PD_ADDR        ((volatile pte_t *) 0xfffff000)
+# define PT_ADDR        ((volatile pte_t *) 0xffc00000)
+#endif
 
-#define PD_INDEX(addr) (((uint32_t) addr >> 22))
-#define PT_INDEX(addr) (((uint32_t) addr >> 12) & 0x3ff)
+#define P_FLAGS_MASK    0xfff
+// Bit 12 is PAT in a large page directory entry, the address starts above it.
+#define P_LARGE_ADDR_MASK (P_ADDR_MASK & ~(pte_t) (LARGE_PAGE_SIZE - 1))
 
-#define PD_ADDR ((volatile uint32_t *) 0xfffff000)
-#define CURR_PD_ADDR ((volatile uint32_t *) 0xfffffffc)
-#define PT_ADDR ((volatile uint32_t *) 0xffc00000)
+#define PD_INDEX(addr) (((uint32_t) (addr) >> PD_SHIFT))
+#define PT_INDEX(addr) (((uint32_t) (addr) >> 12) & (PT_ENTRIES - 1))
 
-#define PT_MISSING (0x00000000)
-#define PD_MISSING (0xffffffff)
+#define PF_PRESENT 0x01 // Page fault error code bits
+#define PF_WRITE   0x02
+
+#define PT_MISSING ((phys_addr_t) 0x00000000)
+#define PD_MISSING ((phys_addr_t) -1)
 
 #define VIRT_OFFSET 0xc0000000
 #define USER_START 0x100000
@@ -24,19 +51,70 @@
 #define USER_END KERNEL_START
 #define KERNEL_END ((uint32_t) PT_ADDR)
 
-extern uint32_t init_pd;
+// Where virt_alloc_kernel and friends find their addresses, see virt.h for the rest.
+#define KERNEL_DYN_START (FRAMES_START + FRAMES_MAX_SIZE)
+#define KERNEL_DYN_END KMAP_START
+
+// The kmap slots get the last page table before the recursive mapping to themselves.
+#define KMAP_START (KERNEL_END - LARGE_PAGE_SIZE)
+#define KMAP_SLOTS 64
+
+// A context is the PDPT (PAE only) followed by its page directories, all in one go.
+#ifdef CONFIG_PAE
+# define CTX_PAGES (1 + PD_COUNT)
+#else
+# define CTX_PAGES PD_COUNT
+#endif
+
+#ifdef CONFIG_PAE
+typedef uint64_t pte_t;
+#else
+typedef uint32_t pte_t;
+#endif
+
+extern pte_t init_pd;
+#ifdef CONFIG_PAE
+extern pte_t init_pdpt;
+#endif
 
 static vmm_ctx_t _kernel_ctx;
 static vmm_ctx_t *kernel_ctx;
+// The context whose page tables show up through the recursive mapping right now, per CPU.
+static vmm_ctx_t *active_ctxs[MAX_CPUS];
+// What virt_abandon_ctx is asking the other CPUs to get off of.
+static vmm_ctx_t *abandoned_ctx = NULL;
+// Every CR3 write flushes the whole TLB (minus global pages), so they're worth counting.
+static uint32_t cr3_writes = 0;
+static kmem_cache_t *ctx_cache;
+
+static phys_addr_t direct_map_end = 0;
+static volatile uint32_t kmap_used[KMAP_SLOTS / 32];
+
+static int large_pages = 0;
+// P_GLOBAL if the CPU can do global pages, 0 otherwise. Every kernel mapping gets it.
+static uint32_t global_flag = 0;
+// Every context copies the kernel's page directory entries when it's made, so once
+// the first one exists, those can't be swapped for large pages anymore.
+static int kernel_pds_shared = 0;
+
+// Covers every page table and vrange tree. It has to nest, the allocators reach back into
+// each other: a vrange node can need a new slab, and that takes pages from vmalloc.
+static recursive_spinlock_t virt_lock = RECURSIVE_SPINLOCK_INIT("virt");
 
 struct vmm_ctx_t {
-    uint32_t *page_dir;
-    uint32_t *page_dir_phys;
+    pte_t *page_dir;        // With PAE, these are all four page directories back to back
+    phys_addr_t page_dir_phys;
+    uint32_t cr3;           // Same as page_dir_phys without PAE, otherwise the PDPT
+    vrange_tree_t ranges;   // Free addresses, the dynamic area for the kernel context
+    vregion_t *regions;     // Where pages get allocated on the first access, user contexts only
+    uint32_t reap_index;    // How far virt_reap_ctx got
+    volatile uint32_t cpus; // Bit n is set while CPU n has it loaded, and might have its pages cached
     // things like swap stuff go here
 };
 
 static inline void flush_tlb() {
     uint32_t tmp = 0;
+    cr3_writes++;
     asm volatile ("mov %%cr3, %0;"
                   "mov %0, %%cr3;"
                   : "=r" (tmp)
@@ -44,55 +122,341 @@ static inline void flush_tlb() {
                   : "memory");
 }
 
-static inline void use_pd(uint32_t *pd_phys) {
-    asm volatile ("mov %0, %%cr3" :: "r" (pd_phys) : "memory");
+static inline void use_pd(uint32_t cr3) {
+    cr3_writes++;
+    asm volatile ("mov %0, %%cr3" :: "r" (cr3) : "memory");
+}
+
+// Reloading CR3 leaves global pages in the TLB. For kernel mappings that changed in a
+// way invlpg can't handle, turning PGE off and on again throws out everything.
+static inline void flush_tlb_all() {
+    if (global_flag == 0) {
+        flush_tlb();
+        return;
+    }
+
+    uint32_t cr4 = cpu_get_cr4();
+    cpu_set_cr4(cr4 & ~CR4_PGE);
+    cpu_set_cr4(cr4);
+}
+
+static int is_kernel(uint32_t virt) {
+    return virt >= KERNEL_START && virt < KERNEL_END;
 }
 
 static inline void invalidate_page(void *addr) {
     asm volatile ("invlpg (%0)" :: "r" (addr) : "memory");
 }
 
-static uint32_t get_phys_in_current(uint32_t virt) {
+static void lock_virt() {
+    // Whoever has the lock might be in a shootdown, waiting for us.
+    spin_lock_recursive(&virt_lock, smp_handle_tlb_flush);
+}
+
+static void unlock_virt() {
+    spin_unlock_recursive(&virt_lock);
+}
+
+static vmm_ctx_t *this_ctx() {
+    return active_ctxs[smp_cpu_id()];
+}
+
+static int is_active(vmm_ctx_t *ctx) {
+    return ctx == this_ctx();
+}
+
+// Other CPUs may have cached the old translations too. Kernel mappings are the same
+// everywhere, user ones only matter where the context is loaded.
+static void shootdown(vmm_ctx_t *ctx, int kernel) {
+    uint32_t mask = kernel ? smp_online_mask() : ctx->cpus;
+    mask &= ~(1u << smp_cpu_id());
+    if (mask != 0) smp_flush_tlbs(mask, kernel ? SMP_FLUSH_GLOBAL : SMP_FLUSH_USER);
+}
+
+// Page tables of the active context are right there through the recursive mapping. Any
+// other context is edited through its page directories, which stay mapped for as long as
+// it lives, and virt_kmap for its page tables. That way, nothing has to switch CR3 (and
+// throw the whole TLB away, twice) just to change another context's mappings.
+static volatile pte_t *get_pd(vmm_ctx_t *ctx) {
+    return is_active(ctx) ? PD_ADDR : ctx->page_dir;
+}
+
+// The page directory entry has to point at a page table. Give it back with put_pt.
+static volatile pte_t *get_pt(vmm_ctx_t *ctx, int pd_index) {
+    if (is_active(ctx)) return PT_ADDR + PT_ENTRIES * pd_index;
+    return virt_kmap(ctx->page_dir[pd_index] & P_ADDR_MASK);
+}
+
+static void put_pt(vmm_ctx_t *ctx, volatile pte_t *pt) {
+    if (!is_active(ctx)) virt_kunmap((void *) pt);
+}
+
+// A page directory entry can be cached as a translation (a large page is a single TLB
+// entry) and as the page table in the recursive mapping. invlpg also clears the
+// paging-structure caches, so one for each is enough.
+static void invalidate_pd_entry(vmm_ctx_t *ctx, int pd_index) {
+    if (is_active(ctx)) {
+        invalidate_page((void *) ((uint32_t) pd_index << PD_SHIFT));
+        invalidate_page((void *) (PT_ADDR + PT_ENTRIES * pd_index));
+    }
+
+    shootdown(ctx, is_kernel((uint32_t) pd_index << PD_SHIFT));
+}
+
+// Fresh page tables can be recycled frames, so they have to be cleared before use.
+static void clear_new_pt(vmm_ctx_t *ctx, int pd_index) {
+    volatile pte_t *pt = get_pt(ctx, pd_index);
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        pt[i] = 0;
+    }
+    put_pt(ctx, pt);
+}
+
+// Points the recursive slots of a set of page directories at themselves.
+static void set_recursive_entries(pte_t *page_dir, phys_addr_t page_dir_phys) {
+    for (uint32_t i = 0; i < PD_COUNT; i++) {
+        page_dir[PD_INDEX(PT_ADDR) + i] = (page_dir_phys + i * PAGE_SIZE) | P_PRESENT | P_WRITABLE;
+    }
+}
+
+static void zero_range(void *addr, uint32_t size) {
+    uint32_t count = size / sizeof(uint32_t);
+    asm volatile ("rep stosl" : "+D" (addr), "+c" (count) : "a" (0) : "memory");
+}
+
+static int is_large(vmm_ctx_t *ctx, uint32_t virt) {
+    pte_t pd_entry = get_pd(ctx)[PD_INDEX(virt)];
+    return (pd_entry & (P_PRESENT | P_LARGE)) == (P_PRESENT | P_LARGE);
+}
+
+static phys_addr_t get_phys(vmm_ctx_t *ctx, uint32_t virt) {
     int pd_index = PD_INDEX(virt);
     int pt_index = PT_INDEX(virt);
 
-    uint32_t pd_entry = PD_ADDR[pd_index];
+    pte_t pd_entry = get_pd(ctx)[pd_index];
     if ((pd_entry & P_PRESENT) == 0) return PD_MISSING;
+    if (pd_entry & P_LARGE) return (pd_entry & P_LARGE_ADDR_MASK) + (virt & (LARGE_PAGE_SIZE - 1));
+
+    volatile pte_t *pt = get_pt(ctx, pd_index);
+    pte_t pt_entry = pt[pt_index];
+    put_pt(ctx, pt);
 
-    volatile uint32_t *pt = PT_ADDR + 1024 * pd_index;
-    uint32_t pt_entry = pt[pt_index];
     if ((pt_entry & P_PRESENT) == 0) return PT_MISSING;
     return pt_entry & P_ADDR_MASK;
 }
 
-static void map_in_current(uint32_t phys, uint32_t virt, uint32_t flags) {
+// Changes to many pages collect their invalidations here and do them all at the end. Past
+// TLB_BATCH_MAX pages, a single flush is cheaper than going page by page.
+#define TLB_BATCH_MAX 32
+
+typedef struct tlb_batch_t {
+    uint32_t pages[TLB_BATCH_MAX];
+    uint32_t count;
+    int global;             // Some of them are kernel pages, which a CR3 reload doesn't flush
+    vmm_ctx_t *ctx;
+} tlb_batch_t;
+
+static void batch_add(tlb_batch_t *batch, vmm_ctx_t *ctx, uint32_t virt) {
+    if (ctx->cpus == 0 && !is_kernel(virt)) return;
+
+    batch->ctx = ctx;
+    if (batch->count < TLB_BATCH_MAX) batch->pages[batch->count] = virt;
+    batch->count++;
+    if (is_kernel(virt)) batch->global = 1;
+}
+
+static void batch_flush(tlb_batch_t *batch) {
+    if (batch->count == 0) return;
+
+    // Other CPUs just flush everything, that's one interrupt no matter how many pages it was.
+    shootdown(batch->ctx, batch->global);
+
+    // Pages of a context loaded elsewhere only, nothing to do here.
+    if (!batch->global && !is_active(batch->ctx)) {
+        batch->count = 0;
+        return;
+    }
+
+    if (batch->count > TLB_BATCH_MAX) {
+        if (batch->global) flush_tlb_all();
+        else flush_tlb();
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            invalidate_page((void *) batch->pages[i]);
+        }
+    }
+
+    batch->count = 0;
+    batch->global = 0;
+}
+
+// Gives a page directory entry a new, empty page table. It's cleared before it goes in,
+// so the CPU never gets to see whatever the frame had in it, and because the entry
+// wasn't present before, there's nothing to invalidate.
+static void add_pt(vmm_ctx_t *ctx, int pd_index) {
+    volatile pte_t *pd = get_pd(ctx);
+
+    // Page tables stay below 4GiB like the contexts, high memory is for whatever gets mapped.
+    phys_addr_t pt_phys = phys_alloc_range_low(PAGE_SIZE);
+    if (pt_phys == 0) panic("virt.c: Out of memory while making a page table!\n");
+
+    // FIXME: is having the page *directory* user accessable fine?
+    pte_t pd_entry = pt_phys | P_USER_ACC | P_WRITABLE | P_PRESENT;
+
+    // While virt_init is still building the direct map, virt_kmap can't be used yet.
+    if (direct_map_end == 0) {
+        pd[pd_index] = pd_entry;
+        clear_new_pt(ctx, pd_index);
+        invalidate_pd_entry(ctx, pd_index);
+        return;
+    }
+
+    void *pt = virt_kmap(pt_phys);
+    zero_range(pt, PAGE_SIZE);
+    virt_kunmap(pt);
+    pd[pd_index] = pd_entry;
+}
+
+// Maps (or with phys and flags 0, unmaps) pages from virt on, up to `size` bytes or the
+// end of virt's page table, whichever comes first. That way the page directory entry is
+// only looked at once for every page table. Missing entries are never cached by the TLB,
+// so only the ones that were present before go in the batch. Returns the number of bytes done.
+static uint32_t map_run(vmm_ctx_t *ctx, phys_addr_t phys, uint32_t virt, uint32_t size, uint32_t flags, tlb_batch_t *batch) {
     int pd_index = PD_INDEX(virt);
-    int pt_index = PT_INDEX(virt);
+    uint32_t run = LARGE_PAGE_SIZE - (virt & (LARGE_PAGE_SIZE - 1));
+    if (run > size) run = size;
 
-    uint32_t pd_entry = PD_ADDR[pd_index];
+    pte_t pd_entry = get_pd(ctx)[pd_index];
     if ((pd_entry & P_PRESENT) == 0) {
-        // FIXME: is having the page *directory* user accessable fine?
-        PD_ADDR[pd_index] = (uint32_t) phys_alloc() | P_USER_ACC | P_WRITABLE | P_PRESENT;
-        flush_tlb();
+        // Nothing to unmap here.
+        if ((flags & P_PRESENT) == 0) return run;
+        add_pt(ctx, pd_index);
+    } else if (pd_entry & P_LARGE) {
+        // Mapping something a large page already maps the same way is fine, e.g.
+        // modules GRUB put right behind the kernel.
+        phys_addr_t large_phys = (pd_entry & P_LARGE_ADDR_MASK) + (virt & (LARGE_PAGE_SIZE - 1));
+        if ((flags & P_PRESENT) && large_phys == (phys & P_ADDR_MASK)) return run;
+        panic("virt.c: Can't change the mapping of %p, it's part of a large page!\n", virt);
     }
 
-    volatile uint32_t *pt = PT_ADDR + 1024 * pd_index;
-    uint32_t pt_entry = pt[pt_index];
-    if ((pt_entry & P_PRESENT) != 0 && (flags & P_PRESENT) != 0) {
-        vga_printf("virt.c: WARNING: Mapping already present for address %p!\n", virt);
+    if ((flags & P_PRESENT) && is_kernel(virt)) flags |= global_flag;
+
+    volatile pte_t *pt = get_pt(ctx, pd_index);
+    for (uint32_t offset = 0; offset < run; offset += PAGE_SIZE) {
+        volatile pte_t *pt_entry = &pt[PT_INDEX(virt + offset)];
+        if (*pt_entry & P_PRESENT) {
+            if (flags & P_PRESENT) vga_printf("virt.c: WARNING: Mapping already present for address %p!\n", virt + offset);
+            batch_add(batch, ctx, virt + offset);
+        }
+
+        *pt_entry = (flags & P_PRESENT) ? ((phys + offset) & P_ADDR_MASK) | (flags & P_FLAGS_MASK) : 0;
+    }
+
+    put_pt(ctx, pt);
+    return run;
+}
+
+static void map_page(vmm_ctx_t *ctx, phys_addr_t phys, uint32_t virt, uint32_t flags) {
+    tlb_batch_t batch = { .count = 0, .global = 0 };
+    map_run(ctx, phys, virt, PAGE_SIZE, flags, &batch);
+    batch_flush(&batch);
+}
+
+static int is_pt_empty(vmm_ctx_t *ctx, int pd_index) {
+    volatile pte_t *pt = get_pt(ctx, pd_index);
+    int empty = 1;
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if (pt[i] & P_PRESENT) {
+            empty = 0;
+            break;
+        }
     }
 
-    pt[pt_index] = (phys & P_ADDR_MASK) | (flags & ~P_ADDR_MASK);
-    invalidate_page((void *) virt);
+    put_pt(ctx, pt);
+    return empty;
 }
 
-static uint32_t find_free_in_range(uint32_t from, uint32_t to) {
-    for (uint32_t addr = from; addr < to; addr += PAGE_SIZE) {
-        uint32_t entry = get_phys_in_current(addr);
-        if ((entry == PD_MISSING) || (entry == PT_MISSING)) return addr;
+// Replaces whatever page table was at virt with one large page. The page table has to be empty.
+static void map_large(vmm_ctx_t *ctx, phys_addr_t phys, uint32_t virt, uint32_t flags) {
+    int pd_index = PD_INDEX(virt);
+    int had_boot_pt = 0;
+
+    volatile pte_t *pd = get_pd(ctx);
+    pte_t pd_entry = pd[pd_index];
+    if (pd_entry & P_PRESENT) {
+        // The boot page tables are part of the kernel image, nobody allocated them.
+        phys_addr_t pt_phys = pd_entry & P_ADDR_MASK;
+        if (phys_get_refs(pt_phys) != 0) phys_free(pt_phys);
+        else had_boot_pt = 1;
     }
 
-    return 0;
+    if (is_kernel(virt)) flags |= global_flag;
+    pd[pd_index] = (phys & P_LARGE_ADDR_MASK) | (flags & P_FLAGS_MASK) | P_LARGE;
+
+    // Those are also the only ones that aren't empty, any of their pages could be cached.
+    if (had_boot_pt) {
+        flush_tlb_all();
+        shootdown(ctx, 1);
+    } else {
+        invalidate_pd_entry(ctx, pd_index);
+    }
+}
+
+static int can_map_large(phys_addr_t phys, uint32_t virt, uint32_t size) {
+    if (!large_pages || kernel_pds_shared) return 0;
+    if ((phys | virt) & (LARGE_PAGE_SIZE - 1)) return 0;
+    if (size < LARGE_PAGE_SIZE) return 0;
+
+    pte_t pd_entry = PD_ADDR[PD_INDEX(virt)];
+    if ((pd_entry & P_PRESENT) == 0) return 1;
+    return (pd_entry & P_LARGE) == 0 && is_pt_empty(this_ctx(), PD_INDEX(virt));
+}
+
+// Turns a large page back into a page table mapping the same memory, so single pages
+// of it can be changed. Each frame of a large page has its own reference count, so
+// the pages don't need to know they used to be one.
+static void split_large_page(vmm_ctx_t *ctx, int pd_index) {
+    volatile pte_t *pd = get_pd(ctx);
+    pte_t pd_entry = pd[pd_index];
+    phys_addr_t phys = pd_entry & P_LARGE_ADDR_MASK;
+    uint32_t flags = pd_entry & P_FLAGS_MASK & ~P_LARGE;
+
+    phys_addr_t pt_phys = phys_alloc_range_low(PAGE_SIZE);
+    if (pt_phys == 0) panic("virt.c: Out of memory while splitting a large page!\n");
+
+    // The page table is filled in before anyone can see it, so it only takes one invalidation.
+    pte_t *pt = virt_kmap(pt_phys);
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        pt[i] = (phys + i * PAGE_SIZE) | flags;
+    }
+    virt_kunmap(pt);
+
+    pd[pd_index] = pt_phys | flags;
+    invalidate_pd_entry(ctx, pd_index);
+}
+
+// Maps physical memory from 0 up to `end` at DIRECT_MAP_START. The kernel image is in there
+// at the same offset boot.asm used, so this takes over from the boot page table too.
+static void map_direct(phys_addr_t end) {
+    for (phys_addr_t phys = 0; phys < end;) {
+        uint32_t virt = DIRECT_MAP_START + (uint32_t) phys;
+        if (large_pages && end - phys >= LARGE_PAGE_SIZE) {
+            map_large(this_ctx(), phys, virt, P_PRESENT | P_WRITABLE);
+            phys += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        // The boot page table already has the kernel image, it only needs to become global.
+        if (get_phys(this_ctx(), virt) != phys) map_page(this_ctx(), phys, virt, P_PRESENT | P_WRITABLE);
+        else PT_ADDR[virt / PAGE_SIZE] |= global_flag;
+        phys += PAGE_SIZE;
+    }
+
+    direct_map_end = end;
+}
+
+static int is_direct(phys_addr_t phys, uint32_t size) {
+    return phys < direct_map_end && size <= direct_map_end - phys;
 }
 
 void virt_init(mb_info_t *mb_info) {
@@ -102,170 +466,923 @@ void virt_init(mb_info_t *mb_info) {
     // bit easier on the eyes and the brain :)
     kernel_ctx = &_kernel_ctx;
     kernel_ctx->page_dir = &init_pd;
-    kernel_ctx->page_dir_phys = (void *) &init_pd - VIRT_OFFSET;
+    kernel_ctx->page_dir_phys = (uint32_t) &init_pd - VIRT_OFFSET;
+#ifdef CONFIG_PAE
+    kernel_ctx->cr3 = (uint32_t) &init_pdpt - VIRT_OFFSET;
+#else
+    kernel_ctx->cr3 = kernel_ctx->page_dir_phys;
+#endif
+    active_ctxs[smp_cpu_id()] = kernel_ctx;
+    kernel_ctx->cpus = 1u << smp_cpu_id();
+    vrange_tree_init(&kernel_ctx->ranges, KERNEL_DYN_START, KERNEL_DYN_END);
+
+    // Get rid of the identity mapping of the first 4MiB boot.asm made.
+    for (uint32_t i = 0; i < PD_INDEX(0x400000); i++) {
+        kernel_ctx->page_dir[i] = 0;
+    }
+
+    set_recursive_entries(kernel_ctx->page_dir, kernel_ctx->page_dir_phys);
 
-    kernel_ctx->page_dir[0] = 0;
-    kernel_ctx->page_dir[0x3ff] = (uint32_t) kernel_ctx->page_dir_phys | P_PRESENT | P_WRITABLE;
+#ifdef CONFIG_PAE
+    // Large pages are always there with PAE, no need to turn them on.
+    large_pages = 1;
+#else
+    large_pages = cpu_has_feature_edx(CPUID_EDX_PSE);
+    if (large_pages) cpu_set_cr4(cpu_get_cr4() | CR4_PSE);
+#endif
 
-    // Prepopulate kernel PTs
-    for (int i = 0x300; i < 0x3ff; i++) {
-        uint32_t *pd_entry = &kernel_ctx->page_dir[i];
+    // The kernel half is the same in every context, so it doesn't need to leave the TLB on
+    // a context switch. The recursive mapping is different in each one, so that stays local.
+    if (cpu_has_feature_edx(CPUID_EDX_PGE)) {
+        cpu_set_cr4(cpu_get_cr4() | CR4_PGE);
+        global_flag = P_GLOBAL;
+    }
+
+    uint64_t mem_end = phys_get_mem_end();
+    map_direct(mem_end < DIRECT_MAP_MAX ? mem_end : DIRECT_MAP_MAX);
+
+    // Prepopulate kernel PTs, so that every context made later shares all of them. That
+    // includes the gap between the end of the direct map and the frame array: it's empty
+    // now, but anything mapped there later still has to show up everywhere.
+    for (uint32_t i = PD_INDEX(KERNEL_START); i < PD_INDEX(KERNEL_END); i++) {
+        pte_t *pd_entry = &kernel_ctx->page_dir[i];
         if (*pd_entry & P_PRESENT) continue;
 
-        *pd_entry = (uint32_t) phys_alloc() | P_PRESENT | P_WRITABLE;
+        *pd_entry = phys_alloc_range_low(PAGE_SIZE) | P_PRESENT | P_WRITABLE;
+        invalidate_pd_entry(kernel_ctx, i);
+        clear_new_pt(kernel_ctx, i);
     }
 
-    // address 0 is mapped to this, which overlaps with PT_MISSING.
-    virt_remove_temp_map((void *) KERNEL_START);
-    virt_mmap_kernel((void *) 0xb8000, (void *) VIRT_OFFSET, PAGE_SIZE);
+    ctx_cache = kmem_cache_create("vmm_ctx_t", sizeof(vmm_ctx_t));
+    vrange_init();
+    vregion_init();
 
+    // Modules are expected at module->start + VIRT_OFFSET, which the direct map takes care of.
     if (mb_info->flags.mods && mb_info->mods.count > 0) {
         mod_t *modules = mb_info->mods.addr + VIRT_OFFSET / sizeof(mod_t);
         for (uint32_t i = 0; i < mb_info->mods.count; i++) {
             mod_t *module = &modules[i];
-            virt_mmap_kernel(module->start,
-                module->start + VIRT_OFFSET,
-                module->end - module->start);
+            if (!is_direct((uint32_t) module->start, module->end - module->start)) {
+                panic("virt.c: Module %d at %p is outside the direct map!\n", i, module->start);
+            }
         }
     }
 
-    flush_tlb();
+    flush_tlb_all();
 }
 
 vmm_ctx_t *virt_new_ctx() {
-    vmm_ctx_t *ctx = virt_alloc_kernel();
-    ctx->page_dir_phys = phys_alloc();
-    ctx->page_dir = virt_temp_map(ctx->page_dir_phys);
-    memset(ctx->page_dir, 0, PAGE_SIZE);
+    lock_virt();
+    vmm_ctx_t *ctx = kmem_cache_alloc(ctx_cache);
+    if (ctx == NULL) panic("virt.c: Out of memory while making a new context!\n");
+    kernel_pds_shared = 1;
 
-    ctx->page_dir[0x3ff] = (uint32_t) ctx->page_dir_phys | P_PRESENT | P_WRITABLE;
-    for (uint32_t i = 0x300; i < 0x3ff; i++) {
+    // CR3 is only 32 bits wide, even with PAE, so the PDPT has to stay below 4GiB.
+    phys_addr_t phys = phys_alloc_range_low(CTX_PAGES * PAGE_SIZE);
+    if (phys == 0) panic("virt.c: Out of memory while making a new context!\n");
+
+    // The page directories stay mapped for as long as the context lives. That's free in the
+    // direct map, anything above it needs its own mapping.
+    uint32_t virt;
+    if (is_direct(phys, CTX_PAGES * PAGE_SIZE)) {
+        virt = DIRECT_MAP_START + (uint32_t) phys;
+    } else {
+        virt = vrange_alloc(&kernel_ctx->ranges, CTX_PAGES * PAGE_SIZE, PAGE_SIZE);
+        if (virt == 0) panic("virt.c: Out of kernel address space while making a new context!\n");
+        virt_mmap_kernel(phys, (void *) virt, CTX_PAGES * PAGE_SIZE);
+    }
+
+    zero_range((void *) virt, CTX_PAGES * PAGE_SIZE);
+
+#ifdef CONFIG_PAE
+    pte_t *pdpt = (pte_t *) virt;
+    ctx->page_dir_phys = phys + PAGE_SIZE;
+    ctx->page_dir = (pte_t *) (virt + PAGE_SIZE);
+    ctx->cr3 = phys;
+
+    // PDPT entries only have the present bit, writable and user are reserved here.
+    for (uint32_t i = 0; i < PD_COUNT; i++) {
+        pdpt[i] = (ctx->page_dir_phys + i * PAGE_SIZE) | P_PRESENT;
+    }
+#else
+    ctx->page_dir_phys = phys;
+    ctx->page_dir = (pte_t *) virt;
+    ctx->cr3 = phys;
+#endif
+
+    vrange_tree_init(&ctx->ranges, USER_START, USER_END);
+    ctx->regions = NULL;
+    ctx->reap_index = PD_INDEX(USER_START);
+
+    set_recursive_entries(ctx->page_dir, ctx->page_dir_phys);
+    for (uint32_t i = PD_INDEX(KERNEL_START); i < PD_INDEX(KERNEL_END); i++) {
         ctx->page_dir[i] = kernel_ctx->page_dir[i];
     }
 
+    unlock_virt();
     return ctx;
 }
 
+vmm_ctx_t *virt_clone_ctx(vmm_ctx_t *ctx) {
+    lock_virt();
+    vmm_ctx_t *clone = virt_new_ctx();
+    vrange_destroy(&clone->ranges);
+    vrange_clone(&clone->ranges, &ctx->ranges);
+    if (!vregion_clone(&clone->regions, ctx->regions)) panic("virt.c: Out of memory while cloning a context!\n");
+
+    volatile pte_t *pd = get_pd(ctx);
+    for (uint32_t pd_index = PD_INDEX(USER_START); pd_index < PD_INDEX(USER_END); pd_index++) {
+        pte_t pd_entry = pd[pd_index];
+        if ((pd_entry & P_PRESENT) == 0) continue;
+
+        // Sharing works page by page, so large pages have to be split up first.
+        if (pd_entry & P_LARGE) {
+            split_large_page(ctx, pd_index);
+            pd_entry = pd[pd_index];
+        }
+
+        // Low zone like every other page table, so it can't come from the zeroed pool.
+        phys_addr_t pt_phys = phys_alloc_range_low(PAGE_SIZE);
+        if (pt_phys == 0) panic("virt.c: Out of memory while cloning a context!\n");
+        pte_t *clone_pt = virt_kmap(pt_phys);
+        zero_range(clone_pt, PAGE_SIZE);
+
+        volatile pte_t *pt = get_pt(ctx, pd_index);
+        for (int pt_index = 0; pt_index < PT_ENTRIES; pt_index++) {
+            pte_t pt_entry = pt[pt_index];
+            if ((pt_entry & P_PRESENT) == 0) continue;
+
+            // Both sides lose write access until one of them writes and gets its own copy.
+            // Shared memory stays shared, that's the whole point of it.
+            if ((pt_entry & (P_WRITABLE | P_COW)) && (pt_entry & P_SHARED) == 0) {
+                pt_entry = (pt_entry & ~(pte_t) P_WRITABLE) | P_COW;
+                pt[pt_index] = pt_entry;
+            }
+
+            clone_pt[pt_index] = pt_entry;
+            phys_ref(pt_entry & P_ADDR_MASK);
+        }
+
+        put_pt(ctx, pt);
+        virt_kunmap(clone_pt);
+        clone->page_dir[pd_index] = pt_phys | (pd_entry & P_FLAGS_MASK);
+    }
+
+    // We just took write access away from a bunch of pages.
+    if (is_active(ctx)) flush_tlb();
+    shootdown(ctx, 0);
+    unlock_virt();
+    return clone;
+}
+
+// Drops a reference to a user frame. Returns 1 if that was the last one, i.e. the frame is free now.
+static uint32_t release_frame(phys_addr_t phys) {
+    uint32_t last = phys_get_refs(phys) == 1;
+    phys_unref(phys);
+    return last;
+}
+
+static int reap_step(vmm_ctx_t *ctx, uint32_t *reclaimed) {
+    if (ctx->cpus != 0) return 0;
+
+    // One page table per call, so nobody has to wait for a big address space to go away.
+    while (ctx->reap_index < PD_INDEX(USER_END)) {
+        int pd_index = ctx->reap_index++;
+        pte_t pd_entry = ctx->page_dir[pd_index];
+        if ((pd_entry & P_PRESENT) == 0) continue;
+
+        ctx->page_dir[pd_index] = 0;
+
+        // Large pages are never shared (virt_clone_ctx splits them), so they can go in one go.
+        if (pd_entry & P_LARGE) {
+            phys_free_range(pd_entry & P_LARGE_ADDR_MASK, LARGE_PAGE_SIZE);
+            *reclaimed += LARGE_PAGE_SIZE / PAGE_SIZE;
+            return 0;
+        }
+
+        phys_addr_t pt_phys = pd_entry & P_ADDR_MASK;
+        pte_t *pt = virt_kmap(pt_phys);
+        for (int i = 0; i < PT_ENTRIES; i++) {
+            if (pt[i] & P_PRESENT) *reclaimed += release_frame(pt[i] & P_ADDR_MASK);
+        }
+        virt_kunmap(pt);
+
+        phys_free(pt_phys);
+        (*reclaimed)++;
+        return 0;
+    }
+
+    // With PAE, the PDPT comes right before the page directories.
+    void *virt = (void *) ctx->page_dir - (CTX_PAGES - PD_COUNT) * PAGE_SIZE;
+    if (!is_direct(ctx->cr3, CTX_PAGES * PAGE_SIZE)) {
+        virt_mmap_kernel(0, virt, CTX_PAGES * PAGE_SIZE);
+        vrange_free(&kernel_ctx->ranges, (uint32_t) virt, CTX_PAGES * PAGE_SIZE);
+    }
+
+    phys_free_range(ctx->cr3, CTX_PAGES * PAGE_SIZE);
+    *reclaimed += CTX_PAGES;
+
+    vrange_destroy(&ctx->ranges);
+    vregion_destroy(&ctx->regions);
+    kmem_cache_free(ctx_cache, ctx);
+    return 1;
+}
+
+int virt_reap_ctx(vmm_ctx_t *ctx, uint32_t *reclaimed) {
+    lock_virt();
+    int done = reap_step(ctx, reclaimed);
+    unlock_virt();
+    return done;
+}
+
 void virt_destroy_ctx(vmm_ctx_t *ctx, int is_current_ctx) {
-    if (is_current_ctx) {
+    if (is_current_ctx || is_active(ctx)) {
         // We need to make sure we don't leave the current PD
         // in some undefined state!
         virt_use(kernel_ctx);
     }
 
-    virt_free_kernel(ctx->page_dir);
-    virt_free_kernel(ctx);
+    uint32_t reclaimed = 0;
+    while (!virt_reap_ctx(ctx, &reclaimed)) {}
 }
 
 void virt_unsafe_identity_map(void *addr) {
-    map_in_current((uint32_t) addr, (uint32_t) addr, P_PRESENT | P_WRITABLE);
+    lock_virt();
+    map_page(this_ctx(), (uint32_t) addr, (uint32_t) addr, P_PRESENT | P_WRITABLE);
+    unlock_virt();
 }
 
-void *virt_temp_map(void *addr) {
-    uint32_t virt = find_free_in_range(KERNEL_START, KERNEL_END);
-    if (virt == 0) return NULL;
-    map_in_current((uint32_t) addr, virt, P_PRESENT | P_WRITABLE);
-    return (void *) virt;
+void virt_unsafe_identity_unmap(void *addr) {
+    lock_virt();
+    map_page(this_ctx(), 0, (uint32_t) addr, 0);
+    unlock_virt();
 }
 
-void virt_remove_temp_map(void *virt) {
-    int pd_index = PD_INDEX(virt);
-    int pt_index = PT_INDEX(virt);
+void *virt_map_mmio(phys_addr_t phys, uint32_t size) {
+    uint32_t offset = phys & (PAGE_SIZE - 1);
+    size = (size + offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    lock_virt();
+    uint32_t start = vrange_alloc(&kernel_ctx->ranges, size, PAGE_SIZE);
+    unlock_virt();
+    if (start == 0) return NULL;
+
+    // Device registers must never be cached, reads and writes have side effects.
+    virt_map_range(kernel_ctx, phys - offset, (void *) start, size, P_PRESENT | P_WRITABLE | P_WRITE_THROUGH | P_CACHE_DISABLE);
+    return (void *) start + offset;
+}
+
+void *virt_kmap(phys_addr_t phys) {
+    if (is_direct(phys, PAGE_SIZE)) return (void *) (DIRECT_MAP_START + (uint32_t) phys);
+
+    // Interrupts may kmap while the idle loop is zeroing a page, so slots are claimed atomically.
+    for (uint32_t slot = 0; slot < KMAP_SLOTS; slot++) {
+        uint32_t bit = 1u << (slot % 32);
+        if (__sync_fetch_and_or(&kmap_used[slot / 32], bit) & bit) continue;
 
-    uint32_t pd_entry = PD_ADDR[pd_index];
-    if ((pd_entry & P_PRESENT) == 0) return;
+        // The kmap page table is shared by all contexts, so this works in whichever one is active.
+        uint32_t virt = KMAP_START + slot * PAGE_SIZE;
+        PT_ADDR[virt / PAGE_SIZE] = (phys & P_ADDR_MASK) | P_PRESENT | P_WRITABLE | global_flag;
+        invalidate_page((void *) virt);
+        return (void *) virt;
+    }
+
+    panic("virt.c: Ran out of kmap slots!\n");
+    return NULL;
+}
+
+void virt_kunmap(void *virt) {
+    uint32_t addr = (uint32_t) virt & ~(PAGE_SIZE - 1);
+
+    // Direct map pages were never mapped in the first place.
+    if (addr < KMAP_START || addr >= KMAP_START + KMAP_SLOTS * PAGE_SIZE) return;
+
+    PT_ADDR[addr / PAGE_SIZE] = 0;
+    invalidate_page((void *) addr);
 
-    volatile uint32_t *pt = PT_ADDR + 1024 * pd_index;
-    pt[pt_index] = 0;
+    uint32_t slot = (addr - KMAP_START) / PAGE_SIZE;
+    __sync_fetch_and_and(&kmap_used[slot / 32], ~(1u << (slot % 32)));
 }
 
 void virt_use(vmm_ctx_t *ctx) {
-    use_pd(ctx->page_dir_phys);
+    // Loading the same CR3 again would only throw the TLB away.
+    uint32_t cpu = smp_cpu_id();
+    vmm_ctx_t *old = active_ctxs[cpu];
+    if (ctx == old) return;
+
+    __sync_fetch_and_or(&ctx->cpus, 1u << cpu);
+    active_ctxs[cpu] = ctx;
+    use_pd(ctx->cr3);
+    __sync_fetch_and_and(&old->cpus, ~(1u << cpu));
 }
 
-void virt_mmap_kernel(void *phys, void *virt, uint32_t size) {
-    if (phys == NULL) {
-        for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
-            virt_remove_temp_map(virt + offset);
-        }
+void virt_use_kernel() {
+    virt_use(kernel_ctx);
+}
+
+void virt_abandon_ctx(vmm_ctx_t *ctx) {
+    // There's only the one abandoned_ctx. Other CPUs read it while we wait for them, and
+    // the lock keeps a second CPU from swapping it out from under them in the meantime.
+    lock_virt();
+    abandoned_ctx = ctx;
+    virt_leave_abandoned();
+
+    uint32_t others = ctx->cpus & ~(1u << smp_cpu_id());
+    if (others != 0) smp_flush_tlbs(others, SMP_FLUSH_ABANDONED);
+    abandoned_ctx = NULL;
+    unlock_virt();
+}
+
+void virt_leave_abandoned() {
+    if (abandoned_ctx != NULL && this_ctx() == abandoned_ctx) virt_use(kernel_ctx);
+}
+
+void virt_init_ap() {
+    uint32_t cpu = smp_cpu_id();
+    active_ctxs[cpu] = kernel_ctx;
+    __sync_fetch_and_or(&kernel_ctx->cpus, 1u << cpu);
+}
+
+uint32_t virt_get_kernel_cr3() {
+    return kernel_ctx->cr3;
+}
+
+void virt_flush_tlb(int global) {
+    if (global) flush_tlb_all();
+    else flush_tlb();
+}
+
+uint32_t virt_get_cr3_writes() {
+    return cr3_writes;
+}
 
+static void check_range(uint32_t virt, uint32_t size) {
+    if ((virt | size) & (PAGE_SIZE - 1)) panic("virt.c: Range %p + %x isn't page aligned!\n", virt, size);
+    if (virt < USER_START || virt >= KERNEL_END || size > KERNEL_END - virt) {
+        panic("virt.c: Range %p + %x is outside of what can be mapped!\n", virt, size);
+    }
+}
+
+void virt_map_range(vmm_ctx_t *ctx, phys_addr_t phys, void *virt, uint32_t size, uint32_t flags) {
+    check_range((uint32_t) virt, size);
+
+    lock_virt();
+    tlb_batch_t batch = { .count = 0, .global = 0 };
+    for (uint32_t offset = 0; offset < size;) {
+        offset += map_run(ctx, phys + offset, (uint32_t) virt + offset, size - offset, flags | P_PRESENT, &batch);
+    }
+
+    batch_flush(&batch);
+    unlock_virt();
+}
+
+void virt_unmap_range(vmm_ctx_t *ctx, void *virt, uint32_t size) {
+    check_range((uint32_t) virt, size);
+
+    lock_virt();
+    tlb_batch_t batch = { .count = 0, .global = 0 };
+    for (uint32_t offset = 0; offset < size;) {
+        offset += map_run(ctx, 0, (uint32_t) virt + offset, size - offset, 0, &batch);
+    }
+
+    batch_flush(&batch);
+    unlock_virt();
+}
+
+void virt_mmap_kernel(phys_addr_t phys, void *virt, uint32_t size) {
+    if (phys == 0) {
+        virt_unmap_range(this_ctx(), virt, size);
         return;
     }
 
-    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        map_in_current((uint32_t) phys + offset, (uint32_t) virt + offset, P_PRESENT | P_WRITABLE);
+    lock_virt();
+    tlb_batch_t batch = { .count = 0, .global = 0 };
+    for (uint32_t offset = 0; offset < size;) {
+        uint32_t addr = (uint32_t) virt + offset;
+        if (can_map_large(phys + offset, addr, size - offset)) {
+            map_large(this_ctx(), phys + offset, addr, P_PRESENT | P_WRITABLE);
+            offset += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        // Stop at the next large page boundary, the part after it might fit a large page again.
+        offset += map_run(this_ctx(), phys + offset, addr, size - offset, P_PRESENT | P_WRITABLE, &batch);
     }
+
+    batch_flush(&batch);
+    unlock_virt();
 }
 
-void *virt_alloc(vmm_ctx_t *ctx) {
-    uint32_t addr = find_free_in_range(USER_START, KERNEL_START);
-    if (addr == 0) return 0;
-    virt_alloc_at(ctx, (void *) addr);
-    return (void *) addr;
+// Drops everything mapped in [from, to) and returns how many pages that was. Large pages
+// sticking out of the range get split first.
+static uint32_t free_user_pages(vmm_ctx_t *ctx, uint32_t from, uint32_t to) {
+    volatile pte_t *pd = get_pd(ctx);
+    tlb_batch_t batch = { .count = 0, .global = 0 };
+    uint32_t freed = 0;
+
+    for (uint32_t addr = from; addr < to;) {
+        int pd_index = PD_INDEX(addr);
+        uint32_t run_end = (addr | (LARGE_PAGE_SIZE - 1)) + 1;
+        if (run_end > to) run_end = to;
+
+        pte_t pd_entry = pd[pd_index];
+        if ((pd_entry & P_PRESENT) == 0) {
+            addr = run_end;
+            continue;
+        }
+
+        if (pd_entry & P_LARGE) {
+            if (run_end - addr == LARGE_PAGE_SIZE) {
+                phys_free_range(pd_entry & P_LARGE_ADDR_MASK, LARGE_PAGE_SIZE);
+                pd[pd_index] = 0;
+                invalidate_pd_entry(ctx, pd_index);
+                freed += LARGE_PAGE_SIZE / PAGE_SIZE;
+                addr = run_end;
+                continue;
+            }
+
+            split_large_page(ctx, pd_index);
+        }
+
+        volatile pte_t *pt = get_pt(ctx, pd_index);
+        for (; addr < run_end; addr += PAGE_SIZE) {
+            volatile pte_t *pt_entry = &pt[PT_INDEX(addr)];
+            if ((*pt_entry & P_PRESENT) == 0) continue;
+
+            phys_unref(*pt_entry & P_ADDR_MASK);
+            *pt_entry = 0;
+            batch_add(&batch, ctx, addr);
+            freed++;
+        }
+
+        put_pt(ctx, pt);
+    }
+
+    batch_flush(&batch);
+    return freed;
+}
+
+static int alloc_large_user_page(vmm_ctx_t *ctx, uint32_t virt) {
+    // The range is free, but other ranges may still use the page table there.
+    pte_t pd_entry = get_pd(ctx)[PD_INDEX(virt)];
+    if ((pd_entry & P_PRESENT) && !is_pt_empty(ctx, PD_INDEX(virt))) return 0;
+
+    // Buddy blocks are aligned to their size, so this is a valid large page if we get it.
+    phys_addr_t phys = phys_alloc_range(LARGE_PAGE_SIZE);
+    if (phys == 0) return 0;
+
+    // The context doesn't have to be the active one, so this can't go through virt.
+    for (uint32_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE) {
+        void *page = virt_kmap(phys + offset);
+        zero_range(page, PAGE_SIZE);
+        virt_kunmap(page);
+    }
+
+    map_large(ctx, phys, virt, P_PRESENT | P_WRITABLE | P_USER_ACC);
+    return 1;
 }
 
-void *virt_alloc_at(vmm_ctx_t *ctx, void *virt) {
+static void *alloc_region(vmm_ctx_t *ctx, uint32_t size, uint32_t flags) {
+
+    int large = (flags & VIRT_REGION_LARGE) && large_pages;
+    uint32_t start = vrange_alloc(&ctx->ranges, size, large ? LARGE_PAGE_SIZE : PAGE_SIZE);
+    if (start == 0) return NULL;
+
+    // Small pages can wait until they're used. Large pages are only worth it up front.
+    if (!large) {
+        if (vregion_add(&ctx->regions, start, start + size, P_WRITABLE | P_USER_ACC)) return (void *) start;
+
+        vrange_free(&ctx->ranges, start, size);
+        return NULL;
+    }
+
+    uint32_t end = start + size;
+    for (uint32_t addr = start; addr < end;) {
+        if (large && end - addr >= LARGE_PAGE_SIZE && alloc_large_user_page(ctx, addr)) {
+            addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        phys_addr_t phys = phys_alloc_zeroed();
+        if (phys == 0) {
+            free_user_pages(ctx, start, addr);
+            vrange_free(&ctx->ranges, start, size);
+            return NULL;
+        }
+
+        map_page(ctx, phys, addr, P_PRESENT | P_WRITABLE | P_USER_ACC);
+        addr += PAGE_SIZE;
+    }
+
+    return (void *) start;
+}
+
+void *virt_alloc_region(vmm_ctx_t *ctx, uint32_t size, uint32_t flags) {
+    if (size == 0 || size > USER_END - USER_START) return NULL;
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    lock_virt();
+    void *start = alloc_region(ctx, size, flags);
+    unlock_virt();
+    return start;
+}
+
+void *virt_alloc_range(vmm_ctx_t *ctx, uint32_t size) {
+    return virt_alloc_region(ctx, size, 0);
+}
+
+void virt_free_range(vmm_ctx_t *ctx, void *virt, uint32_t size) {
+    uint32_t start = (uint32_t) virt & ~(PAGE_SIZE - 1);
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (start < USER_START) panic("Cannot deallocate user memory below 1MiB! (at %p)\n", virt);
+    if (start >= USER_END || size > USER_END - start) panic("Cannot deallocate user memory in kernel region! (at %p)\n", virt);
+    if (size == 0) return;
+
+    lock_virt();
+
+    // Pages of a region that were never touched don't exist, that's fine.
+    int had_region = vregion_remove(&ctx->regions, start, start + size);
+    uint32_t freed = free_user_pages(ctx, start, start + size);
+    if (!had_region && freed < size / PAGE_SIZE) {
+        vga_printf("WARNING: Tried to free unallocated user memory! (in %p - %p)\n", start, start + size);
+    }
+
+    vrange_free(&ctx->ranges, start, size);
+    unlock_virt();
+}
+
+int virt_free_user_range(vmm_ctx_t *ctx, void *virt, uint32_t size) {
+    uint32_t start = (uint32_t) virt;
+    if (start & (PAGE_SIZE - 1)) return 0;
+    if (start < USER_START || start >= USER_END || size > USER_END - start) return 0;
+
+    virt_free_range(ctx, virt, size);
+    return 1;
+}
+
+// Same as virt_alloc_at, some of the range may already be reserved, e.g. when two ELF segments
+// share a page. Going page by page is only worth it then, a big BSS should stay cheap.
+static void reserve_user(vmm_ctx_t *ctx, uint32_t start, uint32_t end) {
+    if (vrange_reserve(&ctx->ranges, start, end - start)) return;
+
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        vrange_reserve(&ctx->ranges, addr, PAGE_SIZE);
+    }
+}
+
+void virt_map_image(vmm_ctx_t *ctx, phys_addr_t phys, void *virt, uint32_t size, int writable) {
+    uint32_t start = (uint32_t) virt;
+    uint32_t end = start + size;
+    if ((start | size) & (PAGE_SIZE - 1)) panic("virt.c: Image mapping at %p isn't page aligned!\n", virt);
+    if (start < USER_START || end > USER_END || end < start) panic("virt.c: Image mapping at %p is outside of user space!\n", virt);
+
+    lock_virt();
+    reserve_user(ctx, start, end);
+
+    // Nobody gets to write to these frames directly, writable images get their own copy
+    // of a page on the first write instead.
+    uint32_t flags = P_PRESENT | P_USER_ACC | (writable ? P_COW : 0);
+
+    for (uint32_t addr = start; addr < end;) {
+        int pd_index = PD_INDEX(addr);
+        uint32_t run_end = (addr | (LARGE_PAGE_SIZE - 1)) + 1;
+        if (run_end > end) run_end = end;
+
+        pte_t pd_entry = get_pd(ctx)[pd_index];
+        if ((pd_entry & P_PRESENT) == 0) add_pt(ctx, pd_index);
+        else if (pd_entry & P_LARGE) panic("virt.c: Can't map an image over the large page at %p!\n", addr);
+
+        volatile pte_t *pt = get_pt(ctx, pd_index);
+        for (; addr < run_end; addr += PAGE_SIZE) {
+            phys_addr_t frame = phys + (addr - start);
+            volatile pte_t *pt_entry = &pt[PT_INDEX(addr)];
+
+            // Two segments sharing a page share the same part of the file as well. If either
+            // of them is writable, the page has to be copy-on-write. It's read-only either way,
+            // so the TLB doesn't need to hear about that.
+            if (*pt_entry & P_PRESENT) {
+                if ((*pt_entry & P_ADDR_MASK) != frame) {
+                    vga_printf("virt.c: WARNING: Mapping already present for address %p!\n", addr);
+                } else if (writable) {
+                    *pt_entry |= P_COW;
+                }
+
+                continue;
+            }
+
+            phys_ref(frame);
+            *pt_entry = (frame & P_ADDR_MASK) | flags;
+        }
+
+        put_pt(ctx, pt);
+    }
+
+    unlock_virt();
+}
+
+void *virt_alloc_lazy_at(vmm_ctx_t *ctx, void *virt, uint32_t size) {
+    uint32_t start = (uint32_t) virt & ~(PAGE_SIZE - 1);
+    uint32_t end = ((uint32_t) virt + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (start < USER_START) panic("Cannot allocate user memory below 1MiB! (at %p)\n", virt);
+    if (end > USER_END || end < start) panic("Cannot allocate user memory in kernel region! (at %p)\n", virt);
+
+    lock_virt();
+    reserve_user(ctx, start, end);
+    int added = vregion_add(&ctx->regions, start, end, P_WRITABLE | P_USER_ACC);
+    unlock_virt();
+    return added ? (void *) start : NULL;
+}
+
+void *virt_alloc_stack(vmm_ctx_t *ctx) {
+    uint32_t bottom = USER_END - USER_STACK_MAX;
+    lock_virt();
+    if (!vrange_reserve(&ctx->ranges, bottom, USER_STACK_MAX)) {
+        unlock_virt();
+        return NULL;
+    }
+
+    // The lowest page stays unmapped, so running off the end faults instead of growing into something else.
+    if (!vregion_add(&ctx->regions, bottom + PAGE_SIZE, USER_END, P_WRITABLE | P_USER_ACC)) {
+        vrange_free(&ctx->ranges, bottom, USER_STACK_MAX);
+        unlock_virt();
+        return NULL;
+    }
+
+    unlock_virt();
+    return (void *) bottom;
+}
+
+phys_addr_t virt_get_phys(vmm_ctx_t *ctx, void *virt) {
+    lock_virt();
+    phys_addr_t phys = get_phys(ctx, (uint32_t) virt);
+    unlock_virt();
+    if (phys == PD_MISSING || phys == PT_MISSING) return 0;
+    return phys + ((uint32_t) virt & (PAGE_SIZE - 1));
+}
+
+// Whether the running process could write to the page itself, maybe after a page fault.
+static int is_user_writable(uint32_t page) {
+    vmm_ctx_t *ctx = this_ctx();
+    phys_addr_t phys = get_phys(ctx, page);
+    if (phys == PD_MISSING || phys == PT_MISSING) {
+        vregion_t *region = vregion_find(ctx->regions, page);
+        return region != NULL && (region->flags & P_WRITABLE);
+    }
+
+    pte_t entry = is_large(ctx, page) ? get_pd(ctx)[PD_INDEX(page)] : PT_ADDR[page / PAGE_SIZE];
+    return (entry & P_USER_ACC) && (entry & (P_WRITABLE | P_COW));
+}
+
+int virt_copy_to_user(void *dst, const void *src, uint32_t size) {
+    uint32_t start = (uint32_t) dst;
+    if (start < USER_START || start >= USER_END || size > USER_END - start) return 0;
+
+    lock_virt();
+    int writable = 1;
+    for (uint32_t page = start & ~(PAGE_SIZE - 1); writable && page < start + size; page += PAGE_SIZE) {
+        writable = is_user_writable(page);
+    }
+    unlock_virt();
+    if (!writable) return 0;
+
+    // Pages that aren't there yet or are still shared fault like they would for the process.
+    memcpy(dst, src, size);
+    return 1;
+}
+
+void *virt_map_shared(vmm_ctx_t *ctx, phys_addr_t *frames, uint32_t count, int writable) {
+    if (count == 0 || count > (USER_END - USER_START) / PAGE_SIZE) return NULL;
+
+    lock_virt();
+    uint32_t start = vrange_alloc(&ctx->ranges, count * PAGE_SIZE, PAGE_SIZE);
+    if (start == 0) {
+        unlock_virt();
+        return NULL;
+    }
+
+    uint32_t flags = P_USER_ACC | P_SHARED | (writable ? P_WRITABLE : 0);
+    for (uint32_t i = 0; i < count;) {
+        // Physically contiguous frames go in as one run.
+        uint32_t run = 1;
+        while (i + run < count && frames[i + run] == frames[i] + run * PAGE_SIZE) run++;
+
+        for (uint32_t j = 0; j < run; j++) {
+            phys_ref(frames[i + j]);
+        }
+
+        virt_map_range(ctx, frames[i], (void *) start + i * PAGE_SIZE, run * PAGE_SIZE, flags);
+        i += run;
+    }
+
+    unlock_virt();
+    return (void *) start;
+}
+
+static phys_addr_t map_user_page(vmm_ctx_t *ctx, void *virt, phys_addr_t phys) {
     if ((uint32_t) virt < USER_START) panic("Cannot allocate user memory below 1MiB! (at %p)\n", virt);
     if ((uint32_t) virt >= USER_END) panic("Cannot allocate user memory in kernel region! (at %p)\n", virt);
 
-    void *phys = phys_alloc();
-    if (phys == NULL) return NULL;
+    if (phys == 0) return 0;
 
-    uint32_t *current_pd = (uint32_t *) (*CURR_PD_ADDR & P_ADDR_MASK);
-    virt_use(ctx);
-    map_in_current((uint32_t) phys, (uint32_t) virt, P_PRESENT | P_WRITABLE | P_USER_ACC);
-    use_pd(current_pd);
+    map_page(ctx, phys, (uint32_t) virt, P_PRESENT | P_WRITABLE | P_USER_ACC);
     return phys;
 }
 
-void *virt_alloc_kernel() {
-    uint32_t addr = find_free_in_range(KERNEL_START, KERNEL_END);
-    if (addr == 0) return 0;
-    virt_alloc_at_kernel((void *) addr);
+void *virt_alloc(vmm_ctx_t *ctx) {
+    lock_virt();
+    uint32_t addr = vrange_alloc(&ctx->ranges, PAGE_SIZE, PAGE_SIZE);
+    if (addr != 0 && map_user_page(ctx, (void *) addr, phys_alloc()) == 0) {
+        vrange_free(&ctx->ranges, addr, PAGE_SIZE);
+        addr = 0;
+    }
+
+    unlock_virt();
     return (void *) addr;
 }
 
-void *virt_alloc_at_kernel(void *virt) {
+// The page may already be reserved, e.g. when two ELF segments share it.
+phys_addr_t virt_alloc_at(vmm_ctx_t *ctx, void *virt) {
+    lock_virt();
+    vrange_reserve(&ctx->ranges, (uint32_t) virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+    phys_addr_t phys = map_user_page(ctx, virt, phys_alloc());
+    unlock_virt();
+    return phys;
+}
+
+phys_addr_t virt_alloc_at_zeroed(vmm_ctx_t *ctx, void *virt) {
+    lock_virt();
+    vrange_reserve(&ctx->ranges, (uint32_t) virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+    phys_addr_t phys = map_user_page(ctx, virt, phys_alloc_zeroed());
+    unlock_virt();
+    return phys;
+}
+
+static phys_addr_t map_kernel_page(void *virt, phys_addr_t phys) {
     if ((uint32_t) virt < KERNEL_START) panic("Cannot allocate kernel memory in user region! (at %p)\n", virt);
     if ((uint32_t) virt >= KERNEL_END) panic("Cannot allocate kernel memory in PD map region! (at %p)\n", virt);
 
-    void *phys = phys_alloc();
-    if (phys == NULL) return NULL;
+    if (phys == 0) return 0;
 
-    map_in_current((uint32_t) phys, (uint32_t) virt, P_PRESENT | P_WRITABLE);
+    map_page(this_ctx(), phys, (uint32_t) virt, P_PRESENT | P_WRITABLE);
     return phys;
 }
 
-void virt_free(vmm_ctx_t *ctx, void *virt) {
-    if ((uint32_t) virt < USER_START) panic("Cannot deallocate user memory below 1MiB! (at %p)\n", virt);
-    if ((uint32_t) virt >= USER_END) panic("Cannot deallocate user memory in kernel region! (at %p)\n", virt);
+static int is_dyn(uint32_t virt) {
+    return virt >= KERNEL_DYN_START && virt < KERNEL_DYN_END;
+}
 
-    uint32_t *current_pd = (uint32_t *) (*CURR_PD_ADDR & P_ADDR_MASK);
-    virt_use(ctx);
+static void *alloc_kernel_pages(uint32_t size, int zeroed) {
+    if (size == 0) return NULL;
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-    uint32_t phys = get_phys_in_current((uint32_t) virt);
-    if (phys == PT_MISSING || phys == PD_MISSING) {
-        use_pd(current_pd);
-        vga_printf("WARNING: Tried to free unallocated user memory! (at %p)\n", virt);
-        return;
+    lock_virt();
+    uint32_t start = vrange_alloc(&kernel_ctx->ranges, size, PAGE_SIZE);
+    if (start == 0) {
+        unlock_virt();
+        return NULL;
+    }
+
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        phys_addr_t phys = zeroed ? phys_alloc_zeroed() : phys_alloc();
+        if (map_kernel_page((void *) start + offset, phys) != 0) continue;
+
+        while (offset > 0) {
+            offset -= PAGE_SIZE;
+            phys_free(get_phys(this_ctx(), start + offset));
+            map_page(this_ctx(), 0, start + offset, 0);
+        }
+
+        vrange_free(&kernel_ctx->ranges, start, size);
+        unlock_virt();
+        return NULL;
     }
 
-    phys_free((void *) phys);
-    map_in_current(0, (uint32_t) virt, 0);
+    unlock_virt();
+    return (void *) start;
+}
+
+void *vmalloc(uint32_t size) {
+    return alloc_kernel_pages(size, 0);
+}
+
+void *vmalloc_zeroed(uint32_t size) {
+    return alloc_kernel_pages(size, 1);
+}
+
+void vfree(void *virt, uint32_t size) {
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        virt_free_kernel(virt + offset);
+    }
+}
+
+void *virt_alloc_kernel() {
+    return alloc_kernel_pages(PAGE_SIZE, 0);
+}
+
+void *virt_alloc_kernel_zeroed() {
+    return alloc_kernel_pages(PAGE_SIZE, 1);
+}
 
-    use_pd(current_pd);
+phys_addr_t virt_alloc_at_kernel(void *virt) {
+    lock_virt();
+    if (is_dyn((uint32_t) virt)) vrange_reserve(&kernel_ctx->ranges, (uint32_t) virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+    phys_addr_t phys = map_kernel_page(virt, phys_alloc());
+    unlock_virt();
+    return phys;
+}
+
+void virt_free(vmm_ctx_t *ctx, void *virt) {
+    virt_free_range(ctx, virt, PAGE_SIZE);
 }
 
 void virt_free_kernel(void *virt) {
     if ((uint32_t) virt < KERNEL_START) panic("Cannot deallocate kernel memory in user region! (at %p)\n", virt);
     if ((uint32_t) virt >= KERNEL_END) panic("Cannot deallocate kernel memory in PD map region! (at %p)\n", virt);
 
-    uint32_t phys = get_phys_in_current((uint32_t) virt);
+    lock_virt();
+    phys_addr_t phys = get_phys(this_ctx(), (uint32_t) virt);
     if (phys == PT_MISSING || phys == PD_MISSING) {
+        unlock_virt();
         vga_printf("WARNING: Tried to free unallocated kernel memory! (at %p)\n", virt);
         return;
     }
 
-    phys_free((void *) phys);
-    map_in_current(0, (uint32_t) virt, 0);
+    if (is_large(this_ctx(), (uint32_t) virt)) {
+        unlock_virt();
+        vga_printf("WARNING: Tried to free part of a large kernel page! (at %p)\n", virt);
+        return;
+    }
+
+    phys_free(phys);
+    map_page(this_ctx(), 0, (uint32_t) virt, 0);
+
+    if (is_dyn((uint32_t) virt)) vrange_free(&kernel_ctx->ranges, (uint32_t) virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+    unlock_virt();
+}
+
+static int handle_cow_fault(uint32_t page) {
+    volatile pte_t *pt_entry = &PT_ADDR[page / PAGE_SIZE];
+    phys_addr_t phys = *pt_entry & P_ADDR_MASK;
+    uint32_t flags = (*pt_entry & P_FLAGS_MASK & ~P_COW) | P_WRITABLE;
+
+    // Everyone else already made their own copy, so this one is ours now.
+    if (phys_get_refs(phys) == 1) {
+        *pt_entry = phys | flags;
+        invalidate_page((void *) page);
+        shootdown(this_ctx(), 0);
+        return 1;
+    }
+
+    phys_addr_t copy_phys = phys_alloc();
+    if (copy_phys == 0) return 0;
+
+    void *copy = virt_kmap(copy_phys);
+    memcpy(copy, (void *) page, PAGE_SIZE);
+    virt_kunmap(copy);
+
+    *pt_entry = copy_phys | flags;
+    invalidate_page((void *) page);
+    shootdown(this_ctx(), 0);
+    phys_unref(phys);
+    return 1;
+}
+
+// First access to a page of a region, it gets a fresh zeroed page.
+static int handle_missing_page(uint32_t page) {
+    vregion_t *region = vregion_find(this_ctx()->regions, page);
+    if (region == NULL) return 0;
+
+    phys_addr_t phys = phys_alloc_zeroed();
+    if (phys == 0) return 0;
+
+    map_page(this_ctx(), phys, page, P_PRESENT | region->flags);
+    return 1;
+}
+
+static int handle_page_fault(uint32_t page, uint32_t err) {
+    phys_addr_t entry = get_phys(this_ctx(), page);
+    if (entry == PD_MISSING || entry == PT_MISSING) {
+        return (err & PF_PRESENT) ? 0 : handle_missing_page(page);
+    }
+    if (is_large(this_ctx(), page)) return 0;
+
+    pte_t pt_entry = PT_ADDR[page / PAGE_SIZE];
+    if ((err & PF_PRESENT) && (err & PF_WRITE) && (pt_entry & P_COW)) {
+        return handle_cow_fault(page);
+    }
+
+    return 0;
+}
+
+int virt_handle_page_fault(void *addr, uint32_t err) {
+    uint32_t page = (uint32_t) addr & ~(PAGE_SIZE - 1);
+    if (page < USER_START || page >= USER_END) return 0;
+
+    lock_virt();
+    int handled = handle_page_fault(page, err);
+    unlock_virt();
+    return handled;
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "../multiboot.h"
+#include "phys.h"
 
 #define P_PRESENT       0x01
 #define P_WRITABLE      0x02
@@ -12,27 +13,127 @@
 #define P_CACHE_DISABLE 0x10
 #define P_ACCESSED      0x20
 #define PT_DIRTY        0x40
+#define P_LARGE         0x80 // Page directory entries only: maps a whole large page, no page table
+#define P_GLOBAL        0x100 // Survives CR3 reloads in the TLB, only for mappings every context has
+
+// What one page directory entry covers, which is also what a large page is.
+#ifdef CONFIG_PAE
+# define LARGE_PAGE_SIZE 0x200000
+#else
+# define LARGE_PAGE_SIZE 0x400000
+#endif
+
+// Bits 9-11 are ignored by the CPU and free for us to use.
+#define P_COW           0x200 // Read-only for now, gets copied on the first write
+#define P_SHARED        0x400 // Deliberately shared between contexts, forks keep sharing it as is
+
+// Kernel address space layout. Physical memory up to DIRECT_MAP_MAX is always mapped at
+// DIRECT_MAP_START + phys, and the frame array phys.c keeps comes right after that.
+#define DIRECT_MAP_START 0xc0000000
+#define DIRECT_MAP_MAX   0x30000000
+#define FRAMES_START     (DIRECT_MAP_START + DIRECT_MAP_MAX)
+#define FRAMES_MAX_SIZE  0x3000000 // Enough for 16GiB
+
+// User stacks sit right below the kernel and can grow up to this size.
+#define USER_STACK_MAX 0x800000
+
+// Flags for virt_alloc_region
+#define VIRT_REGION_LARGE 0x01 // Back the region with large pages where possible
 
 typedef struct vmm_ctx_t vmm_ctx_t;
 
 void virt_init(mb_info_t *mb_info);
 vmm_ctx_t *virt_new_ctx();
+// Makes a new context sharing all user pages of ctx copy-on-write.
+vmm_ctx_t *virt_clone_ctx(vmm_ctx_t *ctx);
+// Frees the context along with all of its user memory and page tables.
 void virt_destroy_ctx(vmm_ctx_t *ctx, int is_current_ctx);
+// Same, but a little at a time: every call frees at most one page table and whatever it maps,
+// and adds the number of frames that went back to phys.c to *reclaimed. Returns 1 once the
+// context is gone. Nothing happens while the context is still active.
+int virt_reap_ctx(vmm_ctx_t *ctx, uint32_t *reclaimed);
 
 void virt_unsafe_identity_map(void *addr);
-void *virt_temp_map(void *phys);
-void virt_remove_temp_map(void *virt);
+void virt_unsafe_identity_unmap(void *addr);
+// Maps device memory somewhere in the kernel half, uncached. Returns NULL on failure.
+void *virt_map_mmio(phys_addr_t phys, uint32_t size);
+// Makes a physical page reachable. Pages in the direct map come back right away, without
+// touching any page tables. Anything else gets one of a few kmap slots until virt_kunmap.
+void *virt_kmap(phys_addr_t phys);
+void virt_kunmap(void *virt);
 
 void virt_use(vmm_ctx_t *ctx);
+// Switches to the context that only has the kernel in it, so no process' context stays active.
+void virt_use_kernel();
+// Makes every CPU that still has ctx loaded switch to the kernel's context. Kernel threads
+// and idle CPUs keep whatever was loaded before, this is for contexts nobody is going to
+// use again, so virt_reap_ctx doesn't have to wait for them.
+void virt_abandon_ctx(vmm_ctx_t *ctx);
+// The SMP_FLUSH_ABANDONED part of virt_abandon_ctx, on the CPU this runs on.
+void virt_leave_abandoned();
+// Lets an AP use the kernel's context, which it loaded itself on the way up.
+void virt_init_ap();
+uint32_t virt_get_kernel_cr3();
+// Flushes this CPU's TLB, without global pages unless `global` is set.
+void virt_flush_tlb(int global);
+// How often CR3 was loaded since boot. Each of those flushes the TLB.
+uint32_t virt_get_cr3_writes();
 
-void virt_mmap_kernel(void *phys, void *virt, uint32_t size);
+// Passing 0 as phys removes the mapping instead.
+void virt_mmap_kernel(phys_addr_t phys, void *virt, uint32_t size);
+// Maps size bytes of physically contiguous memory at virt in ctx (kernel addresses are the
+// same everywhere), or removes the mappings without freeing anything. Page tables are
+// handled once per large page worth of memory and the TLB gets invalidated once at the end.
+void virt_map_range(vmm_ctx_t *ctx, phys_addr_t phys, void *virt, uint32_t size, uint32_t flags);
+void virt_unmap_range(vmm_ctx_t *ctx, void *virt, uint32_t size);
 
 void *virt_alloc(vmm_ctx_t *ctx);
-void *virt_alloc_at(vmm_ctx_t *ctx, void *virt);
+// Reserves `size` bytes of zeroed user memory. The pages only get allocated when they're
+// first touched, by virt_handle_page_fault. Returns NULL on failure.
+void *virt_alloc_range(vmm_ctx_t *ctx, uint32_t size);
+void virt_free_range(vmm_ctx_t *ctx, void *virt, uint32_t size);
+// Same, for ranges a process asks to free. Returns 0 instead of panicking if the range isn't
+// page aligned user space.
+int virt_free_user_range(vmm_ctx_t *ctx, void *virt, uint32_t size);
+// Same as virt_alloc_range, but with VIRT_REGION_LARGE, the region starts at a large page
+// boundary, and every part that a physically contiguous block can be found for uses a
+// large page. Those are allocated right away, and so is the rest, with normal pages.
+// Freed with virt_free_range.
+void *virt_alloc_region(vmm_ctx_t *ctx, uint32_t size, uint32_t flags);
+// Maps size bytes of physically contiguous memory backing a program image (e.g. an initrd
+// module) at virt, read-only. With writable, the pages are copy-on-write instead. Every frame
+// gets a reference per mapping, so whoever owns them has to hold one of its own.
+void virt_map_image(vmm_ctx_t *ctx, phys_addr_t phys, void *virt, uint32_t size, int writable);
+// Like virt_alloc_range, but at a fixed address, e.g. for a BSS. Returns the page-aligned start.
+void *virt_alloc_lazy_at(vmm_ctx_t *ctx, void *virt, uint32_t size);
+// Reserves USER_STACK_MAX bytes at the top of user space and returns the lowest address.
+// The stack grows page by page as it's touched, except for the lowest one, which is a guard.
+void *virt_alloc_stack(vmm_ctx_t *ctx);
+// Returns 0 if nothing is mapped at virt.
+phys_addr_t virt_get_phys(vmm_ctx_t *ctx, void *virt);
+// Copies size bytes to dst in the running process' memory, if it could write there itself.
+// Returns 0 if it couldn't, without copying anything.
+int virt_copy_to_user(void *dst, const void *src, uint32_t size);
+// Maps `count` frames that other contexts may have mapped too, e.g. shared memory, somewhere
+// in ctx. Each frame gets another reference. Returns the address, or NULL.
+void *virt_map_shared(vmm_ctx_t *ctx, phys_addr_t *frames, uint32_t count, int writable);
+// The *_at functions return the physical address of the new page.
+phys_addr_t virt_alloc_at(vmm_ctx_t *ctx, void *virt);
+// Same as virt_alloc_at, but the page is guaranteed to be zeroed.
+phys_addr_t virt_alloc_at_zeroed(vmm_ctx_t *ctx, void *virt);
+// Multi-page kernel allocations. Only virtually contiguous, the pages come from anywhere.
+void *vmalloc(uint32_t size);
+void *vmalloc_zeroed(uint32_t size);
+void vfree(void *virt, uint32_t size);
 void *virt_alloc_kernel();
-void *virt_alloc_at_kernel(void *virt);
+void *virt_alloc_kernel_zeroed();
+phys_addr_t virt_alloc_at_kernel(void *virt);
 
 void virt_free(vmm_ctx_t *ctx, void *virt);
 void virt_free_kernel(void *virt);
 
+// Returns 1 if the fault was resolved (e.g., a copy-on-write page was copied, or a lazily
+// allocated page was touched for the first time), 0 otherwise.
+int virt_handle_page_fault(void *addr, uint32_t err);
+
 #endif
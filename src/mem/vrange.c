@@ -0,0 +1,358 @@
+#include "vrange.h"
+
+#include "slab.h"
+#include "../io/vga.h"
+#include "../misc.h"
+
+// Splitting a range needs one new node, so there are always a couple around before
+// anything in the tree changes. Getting them can reach back into this allocator (the
+// slab needs kernel address space), which would be a bad time to be halfway through a
+// rotation. Merges give nodes back, and anything over MAX_SPARES gets freed afterwards.
+#define MIN_SPARES 2
+#define MAX_SPARES 4
+
+static kmem_cache_t *node_cache = NULL;
+
+static int32_t height(vrange_t *node) {
+    return node == NULL ? 0 : node->height;
+}
+
+static uint32_t max_size(vrange_t *node) {
+    return node == NULL ? 0 : node->max_size;
+}
+
+static void update(vrange_t *node) {
+    int32_t left = height(node->left);
+    int32_t right = height(node->right);
+    node->height = 1 + (left > right ? left : right);
+
+    uint32_t max = node->size;
+    if (max_size(node->left) > max) max = max_size(node->left);
+    if (max_size(node->right) > max) max = max_size(node->right);
+    node->max_size = max;
+}
+
+static vrange_t *rotate_left(vrange_t *node) {
+    vrange_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update(node);
+    update(right);
+    return right;
+}
+
+static vrange_t *rotate_right(vrange_t *node) {
+    vrange_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update(node);
+    update(left);
+    return left;
+}
+
+static vrange_t *balance(vrange_t *node) {
+    update(node);
+    int32_t diff = height(node->left) - height(node->right);
+
+    if (diff > 1) {
+        if (height(node->left->left) < height(node->left->right)) node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+
+    if (diff < -1) {
+        if (height(node->right->right) < height(node->right->left)) node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+static vrange_t *insert(vrange_t *root, vrange_t *node) {
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        update(node);
+        return node;
+    }
+
+    if (node->start < root->start) root->left = insert(root->left, node);
+    else root->right = insert(root->right, node);
+    return balance(root);
+}
+
+static vrange_t *remove_min(vrange_t *root, vrange_t **min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = remove_min(root->left, min);
+    return balance(root);
+}
+
+static vrange_t *remove_start(vrange_t *root, uint32_t start) {
+    if (root == NULL) return NULL;
+
+    if (start < root->start) {
+        root->left = remove_start(root->left, start);
+    } else if (start > root->start) {
+        root->right = remove_start(root->right, start);
+    } else {
+        if (root->left == NULL) return root->right;
+        if (root->right == NULL) return root->left;
+
+        vrange_t *successor;
+        vrange_t *right = remove_min(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return balance(successor);
+    }
+
+    return balance(root);
+}
+
+// The node with the biggest start <= addr.
+static vrange_t *find_floor(vrange_t *node, uint32_t addr) {
+    vrange_t *found = NULL;
+    while (node != NULL) {
+        if (node->start <= addr) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return found;
+}
+
+// The node with the smallest start >= addr.
+static vrange_t *find_ceil(vrange_t *node, uint32_t addr) {
+    vrange_t *found = NULL;
+    while (node != NULL) {
+        if (node->start >= addr) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
+static uint32_t align_up(uint32_t addr, uint32_t align) {
+    return (addr + align - 1) & ~(align - 1);
+}
+
+static int fits(vrange_t *node, uint32_t size, uint32_t align) {
+    uint32_t start = align_up(node->start, align);
+    if (start < node->start) return 0; // Wrapped around
+    return start - node->start <= node->size && node->size - (start - node->start) >= size;
+}
+
+// Lowest address first. max_size lets us skip subtrees that are too small either way,
+// which makes this O(log n) unless the alignment is bigger than a page.
+static vrange_t *find_fit(vrange_t *node, uint32_t size, uint32_t align) {
+    if (node == NULL || node->max_size < size) return NULL;
+
+    vrange_t *found = find_fit(node->left, size, align);
+    if (found != NULL) return found;
+    if (fits(node, size, align)) return node;
+    return find_fit(node->right, size, align);
+}
+
+static void push_spare(vrange_tree_t *tree, vrange_t *node) {
+    node->left = tree->spares;
+    tree->spares = node;
+    tree->spare_count++;
+}
+
+static vrange_t *pop_spare(vrange_tree_t *tree) {
+    vrange_t *node = tree->spares;
+    if (node == NULL) return NULL;
+
+    tree->spares = node->left;
+    tree->spare_count--;
+    return node;
+}
+
+// The embedded node isn't from the slab, so it has to stay.
+static vrange_t *pop_freeable_spare(vrange_tree_t *tree) {
+    for (vrange_t **link = &tree->spares; *link != NULL; link = &(*link)->left) {
+        vrange_t *node = *link;
+        if (node == &tree->first) continue;
+
+        *link = node->left;
+        tree->spare_count--;
+        return node;
+    }
+
+    return NULL;
+}
+
+static void prepare(vrange_tree_t *tree) {
+    if (tree->busy || node_cache == NULL) return;
+    tree->busy = 1;
+
+    while (tree->spare_count < MIN_SPARES) {
+        vrange_t *node = kmem_cache_alloc(node_cache);
+        if (node == NULL) break;
+        push_spare(tree, node);
+    }
+
+    tree->busy = 0;
+}
+
+static void finish(vrange_tree_t *tree) {
+    if (tree->busy) return;
+    tree->busy = 1;
+
+    while (tree->spare_count > MAX_SPARES) {
+        vrange_t *node = pop_freeable_spare(tree);
+        if (node == NULL) break;
+        kmem_cache_free(node_cache, node);
+    }
+
+    tree->busy = 0;
+}
+
+static void insert_range(vrange_tree_t *tree, vrange_t *node, uint32_t start, uint32_t size) {
+    node->start = start;
+    node->size = size;
+    tree->root = insert(tree->root, node);
+}
+
+// Takes [start, start + size) out of the free range `node`, which has to contain it.
+static int carve(vrange_tree_t *tree, vrange_t *node, uint32_t start, uint32_t size) {
+    uint32_t before = start - node->start;
+    uint32_t after = node->size - before - size;
+
+    vrange_t *extra = NULL;
+    if (before > 0 && after > 0) {
+        extra = pop_spare(tree);
+        if (extra == NULL) return 0;
+    }
+
+    uint32_t node_start = node->start;
+    tree->root = remove_start(tree->root, node_start);
+
+    if (before > 0) insert_range(tree, node, node_start, before);
+    if (after > 0) insert_range(tree, before > 0 ? extra : node, start + size, after);
+    if (before == 0 && after == 0) push_spare(tree, node);
+    return 1;
+}
+
+void vrange_init() {
+    node_cache = kmem_cache_create("vrange_t", sizeof(vrange_t));
+    if (node_cache == NULL) panic("vrange.c: Couldn't create the node cache!\n");
+}
+
+void vrange_tree_init(vrange_tree_t *tree, uint32_t start, uint32_t end) {
+    tree->root = NULL;
+    tree->spares = NULL;
+    tree->spare_count = 0;
+    tree->busy = 0;
+
+    if (end > start) {
+        insert_range(tree, &tree->first, start, end - start);
+    } else {
+        push_spare(tree, &tree->first);
+    }
+}
+
+static void clone_nodes(vrange_tree_t *dst, vrange_t *node) {
+    if (node == NULL) return;
+
+    clone_nodes(dst, node->left);
+    vrange_free(dst, node->start, node->size);
+    clone_nodes(dst, node->right);
+}
+
+void vrange_clone(vrange_tree_t *dst, vrange_tree_t *src) {
+    vrange_tree_init(dst, 0, 0);
+    clone_nodes(dst, src->root);
+}
+
+static void destroy_nodes(vrange_tree_t *tree, vrange_t *node) {
+    if (node == NULL) return;
+
+    destroy_nodes(tree, node->left);
+    destroy_nodes(tree, node->right);
+    if (node != &tree->first) kmem_cache_free(node_cache, node);
+}
+
+void vrange_destroy(vrange_tree_t *tree) {
+    destroy_nodes(tree, tree->root);
+    tree->root = NULL;
+
+    vrange_t *node;
+    while ((node = pop_spare(tree)) != NULL) {
+        if (node != &tree->first) kmem_cache_free(node_cache, node);
+    }
+}
+
+uint32_t vrange_alloc(vrange_tree_t *tree, uint32_t size, uint32_t align) {
+    if (size == 0) return 0;
+    prepare(tree);
+
+    vrange_t *node = find_fit(tree->root, size, align);
+    uint32_t start = node == NULL ? 0 : align_up(node->start, align);
+    if (node != NULL && !carve(tree, node, start, size)) start = 0;
+
+    finish(tree);
+    return start;
+}
+
+int vrange_reserve(vrange_tree_t *tree, uint32_t start, uint32_t size) {
+    if (size == 0) return 1;
+    prepare(tree);
+
+    vrange_t *node = find_floor(tree->root, start);
+    int ok = node != NULL
+        && start - node->start <= node->size
+        && node->size - (start - node->start) >= size
+        && carve(tree, node, start, size);
+
+    finish(tree);
+    return ok;
+}
+
+void vrange_free(vrange_tree_t *tree, uint32_t start, uint32_t size) {
+    if (size == 0) return;
+    prepare(tree);
+
+    uint32_t end = start + size;
+    vrange_t *prev = start == 0 ? NULL : find_floor(tree->root, start - 1);
+    vrange_t *next = find_ceil(tree->root, start);
+
+    if ((prev != NULL && prev->start + prev->size > start) || (next != NULL && next->start < end)) {
+        vga_printf("vrange.c: WARNING: Tried to free %p - %p, which is already free!\n", start, end);
+        finish(tree);
+        return;
+    }
+
+    int merge_prev = prev != NULL && prev->start + prev->size == start;
+    int merge_next = next != NULL && next->start == end;
+
+    if (merge_next) {
+        size += next->size;
+        tree->root = remove_start(tree->root, next->start);
+        push_spare(tree, next);
+    }
+
+    if (merge_prev) {
+        uint32_t prev_start = prev->start;
+        tree->root = remove_start(tree->root, prev_start);
+        insert_range(tree, prev, prev_start, prev->size + size);
+    } else {
+        vrange_t *node = pop_spare(tree);
+        if (node == NULL) {
+            vga_printf("vrange.c: WARNING: Out of nodes, leaking %p - %p!\n", start, end);
+        } else {
+            insert_range(tree, node, start, size);
+        }
+    }
+
+    finish(tree);
+}
@@ -0,0 +1,41 @@
+#ifndef VRANGE_H
+#define VRANGE_H
+
+#include <stdint.h>
+
+// Free parts of an address space, kept in an AVL tree sorted by start address.
+// Everything that isn't in the tree is in use.
+typedef struct vrange_t {
+    uint32_t start;
+    uint32_t size;
+    uint32_t max_size;      // Biggest size in this subtree, so searches can skip whole subtrees
+    int32_t height;
+    struct vrange_t *left;  // Also links the spare nodes together
+    struct vrange_t *right;
+} vrange_t;
+
+typedef struct vrange_tree_t {
+    vrange_t *root;
+    vrange_t *spares;       // Nodes taken from the slab ahead of time, see vrange.c
+    uint32_t spare_count;
+    int busy;
+    vrange_t first;         // Every tree comes with one node that doesn't need the slab
+} vrange_tree_t;
+
+// Creates the node cache. Trees can be used before that, as long as nothing needs a second node.
+void vrange_init();
+
+// Starts out with [start, end) free. start == end makes an empty tree.
+void vrange_tree_init(vrange_tree_t *tree, uint32_t start, uint32_t end);
+// Makes dst (which must not be initialized yet) have the same free ranges as src.
+void vrange_clone(vrange_tree_t *dst, vrange_tree_t *src);
+void vrange_destroy(vrange_tree_t *tree);
+
+// Finds the lowest free range of `size` bytes starting at a multiple of `align`, marks it as used,
+// and returns its start. Returns 0 if there's no such range.
+uint32_t vrange_alloc(vrange_tree_t *tree, uint32_t size, uint32_t align);
+// Marks a specific range as used. Returns 0 if any part of it wasn't free.
+int vrange_reserve(vrange_tree_t *tree, uint32_t start, uint32_t size);
+void vrange_free(vrange_tree_t *tree, uint32_t start, uint32_t size);
+
+#endif
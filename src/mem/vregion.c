@@ -0,0 +1,106 @@
+#include "vregion.h"
+
+#include "slab.h"
+#include "../misc.h"
+
+// Processes only ever have a handful of these (their BSS, stack and whatever they
+// allocated), so a sorted list does the job.
+
+static kmem_cache_t *region_cache = NULL;
+
+static vregion_t *new_region(uint32_t start, uint32_t end, uint32_t flags, vregion_t *next) {
+    vregion_t *region = kmem_cache_alloc(region_cache);
+    if (region == NULL) return NULL;
+
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->next = next;
+    return region;
+}
+
+void vregion_init() {
+    region_cache = kmem_cache_create("vregion_t", sizeof(vregion_t));
+    if (region_cache == NULL) panic("vregion.c: Couldn't create the region cache!\n");
+}
+
+int vregion_add(vregion_t **list, uint32_t start, uint32_t end, uint32_t flags) {
+    if (end <= start) return 1;
+
+    // Regions never overlap, the new one wins.
+    vregion_remove(list, start, end);
+
+    vregion_t **link = list;
+    while (*link != NULL && (*link)->start < start) link = &(*link)->next;
+
+    vregion_t *region = new_region(start, end, flags, *link);
+    if (region == NULL) return 0;
+
+    *link = region;
+    return 1;
+}
+
+vregion_t *vregion_find(vregion_t *list, uint32_t addr) {
+    for (vregion_t *region = list; region != NULL && region->start <= addr; region = region->next) {
+        if (addr < region->end) return region;
+    }
+
+    return NULL;
+}
+
+int vregion_remove(vregion_t **list, uint32_t start, uint32_t end) {
+    if (end <= start) return 0;
+    int found = 0;
+
+    vregion_t **link = list;
+    while (*link != NULL && (*link)->start < end) {
+        vregion_t *region = *link;
+        if (region->end <= start) {
+            link = &region->next;
+            continue;
+        }
+
+        found = 1;
+        if (region->start < start && region->end > end) {
+            // Punching a hole in the middle leaves two regions.
+            vregion_t *tail = new_region(end, region->end, region->flags, region->next);
+            if (tail == NULL) panic("vregion.c: Out of memory while splitting a region!\n");
+
+            region->end = start;
+            region->next = tail;
+            break;
+        }
+
+        if (region->start < start) {
+            region->end = start;
+            link = &region->next;
+        } else if (region->end > end) {
+            region->start = end;
+            break;
+        } else {
+            *link = region->next;
+            kmem_cache_free(region_cache, region);
+        }
+    }
+
+    return found;
+}
+
+int vregion_clone(vregion_t **dst, vregion_t *src) {
+    vregion_t **link = dst;
+    for (vregion_t *region = src; region != NULL; region = region->next) {
+        *link = new_region(region->start, region->end, region->flags, NULL);
+        if (*link == NULL) return 0;
+        link = &(*link)->next;
+    }
+
+    return 1;
+}
+
+void vregion_destroy(vregion_t **list) {
+    while (*list != NULL) {
+        vregion_t *region = *list;
+        *list = region->next;
+        kmem_cache_free(region_cache, region);
+    }
+}
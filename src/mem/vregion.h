@@ -0,0 +1,29 @@
+#ifndef VREGION_H
+#define VREGION_H
+
+#include <stdint.h>
+
+// Parts of a user address space that get their pages on the first access instead of
+// up front, kept in a list sorted by start address. The context keeps the addresses
+// reserved in its vrange tree for as long as a region covers them.
+typedef struct vregion_t {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;         // Page flags the pages get mapped with
+    struct vregion_t *next;
+} vregion_t;
+
+void vregion_init();
+
+// Replaces any regions in [start, end). Returns 0 if there's no memory for the descriptor.
+int vregion_add(vregion_t **list, uint32_t start, uint32_t end, uint32_t flags);
+// The region addr is in, or NULL.
+vregion_t *vregion_find(vregion_t *list, uint32_t addr);
+// Takes [start, end) out of every region, splitting them where needed. Returns 1 if
+// any region covered part of it.
+int vregion_remove(vregion_t **list, uint32_t start, uint32_t end);
+// Makes *dst (which must be empty) a copy of src. Returns 0 if it ran out of memory.
+int vregion_clone(vregion_t **dst, vregion_t *src);
+void vregion_destroy(vregion_t **list);
+
+#endif
@@ -9,6 +9,7 @@
 #endif
 
 void outb(uint16_t port, uint8_t byte);
+uint8_t inb(uint16_t port);
 
 void memset(void *ptr, uint8_t byte, uint32_t count);
 void memcpy(void *restrict dst, const void *restrict src, uint32_t count);
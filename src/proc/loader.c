@@ -20,6 +20,42 @@ static void validate_elf(elf_header_t *elf) {
     if (elf->version != elf->ident.version) panic("Expected ELF version and ident version to be equal!\n");
 }
 
+// Copies the segment's file data in that page into a page of its own, the rest of the page
+// is zero. Two segments can share a page, so it might be there already.
+static void load_page(vmm_ctx_t *vctx, elf_header_t *elf, uint32_t size, elf_program_header_t *ph, uint32_t page) {
+    phys_addr_t image_phys = (uint32_t) elf - DIRECT_MAP_START;
+    uint32_t file_end = ph->v_addr + ph->file_size;
+    uint32_t mem_end = ph->v_addr + ph->mem_size;
+    phys_addr_t phys = virt_get_phys(vctx, (void *) page);
+
+    // An earlier segment mapped this page straight from the module, it needs its own copy
+    // before anything gets written to it.
+    if (phys >= image_phys && phys < image_phys + size) {
+        void *orig = (void *) elf + (phys - image_phys);
+        virt_free(vctx, (void *) page);
+        phys = virt_alloc_at(vctx, (void *) page);
+        if (phys == 0) panic("Out of memory while loading an ELF file!\n");
+
+        void *tmp = virt_kmap(phys);
+        memcpy(tmp, orig, 4096);
+        virt_kunmap(tmp);
+    }
+
+    if (phys == 0) phys = virt_alloc_at_zeroed(vctx, (void *) page);
+    if (phys == 0) panic("Out of memory while loading an ELF file!\n");
+
+    uint32_t from = page > ph->v_addr ? page : ph->v_addr;
+    uint32_t to = page + 4096 < file_end ? page + 4096 : file_end;
+    uint32_t zero_to = page + 4096 < mem_end ? page + 4096 : mem_end;
+    if (to < from) to = from;
+
+    void *tmp = virt_kmap(phys);
+    memcpy(tmp + (from - page), (void *) elf + ph->offset + (from - ph->v_addr), to - from);
+    // Only matters for a page copied from the module, fresh ones are zero anyway.
+    if (to < zero_to) memset(tmp + (to - page), 0, zero_to - to);
+    virt_kunmap(tmp);
+}
+
 void loader_load_elf(elf_header_t *elf, uint32_t size) {
     vga_printf("elf %p\n", elf);
 
@@ -29,6 +65,9 @@ void loader_load_elf(elf_header_t *elf, uint32_t size) {
     proc_t *proc = proc_new((void*) elf->entry);
     vmm_ctx_t *vctx = proc_get_vmm_ctx(proc);
 
+    // Modules always end up in the direct map, so this is where the file is in memory.
+    phys_addr_t image_phys = (uint32_t) elf - DIRECT_MAP_START;
+
     for (uint32_t i = 0; i < elf->ph_num; i++, ph++) {
         if (ph->type != PT_LOAD) {
             vga_printf("skipping %d\n", ph->type);
@@ -39,25 +78,53 @@ void loader_load_elf(elf_header_t *elf, uint32_t size) {
             panic("File size was bigger than mem size!\n");
         }
 
-        if (ph->file_size > size) {
+        if (ph->offset + ph->file_size > size || ph->offset + ph->file_size < ph->offset) {
             panic("File size was bigger than the provided ELF binary!\n");
         }
 
         vga_printf("paddr %p, vaddr %p\n", ph->p_addr, ph->v_addr);
 
-        for (uint32_t i = ph->file_size; i < ph->mem_size; i += 4096) {
-            void *mem = virt_alloc_at(vctx, ph->v_addr + (void *) i);
+        uint32_t page_start = ph->v_addr & ~4095;
+        uint32_t file_end = ph->v_addr + ph->file_size;
+        uint32_t file_pages_end = (file_end + 4095) & ~4095;
+        uint32_t mem_end = ph->v_addr + ph->mem_size;
+
+        // If the segment sits at the same offset into its pages as it does in the file, the
+        // module's own pages can be mapped. Everyone running this module shares them, and
+        // writable segments only get copies of the pages they write to. A partial last page
+        // has to be copied, the rest of it in the module is whatever comes next in the file.
+        uint32_t copy_start = page_start;
+        if (((ph->v_addr ^ ph->offset) & 4095) == 0) {
+            // A page that's there already is the last one of an earlier segment, which is a
+            // copy. This segment's part goes into that copy as well.
+            uint32_t direct_start = page_start;
+            if (virt_get_phys(vctx, (void *) page_start) != 0) {
+                load_page(vctx, elf, size, ph, page_start);
+                direct_start += 4096;
+            }
+
+            uint32_t direct_end = file_end & ~4095;
+            if (direct_end > direct_start) {
+                phys_addr_t phys = image_phys + ph->offset - (ph->v_addr - page_start) + (direct_start - page_start);
+
+                // The module holds on to its frames forever, unmapping them must never free them.
+                for (phys_addr_t frame = phys; frame < phys + (direct_end - direct_start); frame += 4096) {
+                    if (phys_get_refs(frame) == 0) phys_ref(frame);
+                }
+
+                virt_map_image(vctx, phys, (void *) direct_start, direct_end - direct_start, ph->flags & PF_W);
+            }
+
+            copy_start = direct_end > direct_start ? direct_end : direct_start;
+        }
 
-            void *v_mem = virt_temp_map(mem);
-            memset(v_mem, 0, 4096);
-            virt_remove_temp_map(v_mem);
+        for (uint32_t page = copy_start; page < file_pages_end; page += 4096) {
+            load_page(vctx, elf, size, ph, page);
         }
 
-        for (uint32_t i = 0; i < ph->file_size; i += 4096) {
-            void *phys = virt_alloc_at(vctx, (void *) ph->v_addr + i);
-            void *tmp = virt_temp_map(phys);
-            memcpy(tmp, (void *) elf + ph->offset + i, 4096);
-            virt_remove_temp_map(tmp);
+        // Whatever is left is pure BSS, which only gets pages when the program uses them.
+        if (mem_end > file_pages_end && virt_alloc_lazy_at(vctx, (void *) file_pages_end, mem_end - file_pages_end) == NULL) {
+            panic("Out of memory while loading an ELF file!\n");
         }
     }
 }
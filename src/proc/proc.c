@@ -1,38 +1,258 @@
 #include "proc.h"
 
+#include <stddef.h>
+
 #include "../io/vga.h"
+#include "../ipc/shm.h"
 #include "../misc.h"
+#include "../mem/phys.h"
+#include "../mem/slab.h"
 #include "../timer/timer.h"
 #include "loader.h"
+#include "work.h"
+#include "../x86/fpu.h"
 #include "../x86/gdt.h"
+#include "../x86/smp.h"
+#include "../x86/spinlock.h"
+
+// How many PIDs the table starts out with. It doubles whenever it runs out.
+#define PID_TABLE_INITIAL 64
 
-#define MAX_PROCS 3
+typedef enum {
+    PROC_RUNNABLE,
+    PROC_WAITING,
+    PROC_DEAD,
+} proc_status_t;
 
 struct proc_t {
     uint32_t id;
+    proc_status_t status;
+    uint32_t priority;
+    uint32_t generation;    // Of its PID, see pid_slot_t
+    uint32_t parent;        // Who forked it, PID_NONE if nobody did
+    uint32_t parent_generation; // Tells the parent apart from later holders of its PID
+    uint32_t cpu;           // Whose run queue it's on, or which CPU runs it
+    uint64_t woken_at;      // When proc_wake last made it runnable, in us
+    uint64_t ready_since;   // When it last went on a run queue, in us
+    uint64_t last_run;      // When it last got a CPU, in us
+    uint64_t run_time;      // Time on a CPU in us, up to the start of its current turn
+    uint64_t ready_time;    // Time on a run queue in us
+    uint32_t voluntary_switches;
+    uint32_t involuntary_switches;
+    timer_t sleep_timer;    // Pending while it's in proc_sleep
     int_ctx_t *state;
     void *stack;
     void *user_stack;
-    vmm_ctx_t *vmm_ctx;
+    vmm_ctx_t *vmm_ctx;     // NULL for kernel threads
+    void *fpu_area;         // Where its FPU state gets saved, NULL until it first uses the FPU
+    uint32_t fpu_cpu;       // Which CPU last loaded that state
+    uint32_t reclaimed;     // Frames freed so far after it exited
     proc_t *prev;
-    proc_t *next;
+    proc_t *next;           // Links the queue it's on, including the one for exited processes
 };
 
-typedef struct __attribute__((packed)) dangling_stack_t {
-    uint32_t stack_data[1023];
-    struct dangling_stack_t *next;
-} dangling_stack_t;
+typedef struct {
+    proc_t *head;
+    proc_t *tail;
+} proc_queue_t;
+
+// PIDs index straight into this. Free slots form a list through next_free, so freed IDs get
+// handed out again before the table has to grow.
+typedef struct {
+    proc_t *proc;
+    uint32_t next_free;
+    uint32_t generation;    // Goes up every time the ID is handed out
+} pid_slot_t;
+
+#define PID_NONE ((uint32_t) -1)
+
+static pid_slot_t *pid_table = NULL;
+static uint32_t pid_table_size = 0;
+static uint32_t pid_next_free = PID_NONE;
+static uint32_t pid_count = 0;   // Slots that were ever handed out
+
+// Every CPU schedules on its own. The running process is on neither queue. Runnable ones
+// wait their turn in the run queue for their priority on some CPU, blocked ones sit in
+// wait_queue, where the scheduler never has to look at them. Bit n of ready_levels is set if
+// run_queues[n] isn't empty. proc_lock covers all of it, so CPUs can take work off each
+// other's queues.
+typedef struct {
+    proc_t *curr;
+    proc_queue_t run_queues[PRIO_COUNT];
+    uint32_t ready_levels;
+    uint32_t ready_count;
+    uint64_t slice_end;
+    // With nothing to run, the CPU goes back to proc_idle, which main and the APs end in.
+    // This is where it was interrupted. It's also running before the first process ever does.
+    int_ctx_t *idle_state;
+    int is_idle;
+    // The running process gave up the CPU itself, through proc_yield.
+    int is_yielding;
+    // Whose state is in the FPU. If that process comes back, and nobody else used the FPU
+    // in between, it can go on without a #NM.
+    proc_t *fpu_owner;
+} sched_t;
+
+static sched_t scheds[MAX_CPUS];
+static proc_queue_t wait_queue = { NULL, NULL };
+
+// How long a process gets to run at once, per priority. Higher priorities get shorter slices,
+// they're for things that want to react quickly, not to hog the CPU.
+static const uint32_t quantum_ms[PRIO_COUNT] = { 2, 4, 6, 8, 10, 20, 40, 80 };
+// The longest it took any process to get the CPU after proc_wake, per priority, in us.
+static uint32_t max_wake_latency[PRIO_COUNT];
+// Exited processes whose memory hasn't been freed yet, see reap.
+static proc_t *dead_procs = NULL;
+static void reap(work_t *work);
+static work_t reap_work = { .fn = reap };
+static void sleep_done(timer_t *timer);
+static uint32_t reclaimed_frames = 0;
+static kmem_cache_t *proc_cache = NULL;
+static kmem_cache_t *fpu_cache = NULL;
+
+// Covers the queues, the PID table and dead_procs. Nothing in here calls out to anything that
+// might come back while holding it, e.g. work_post and virt_abandon_ctx.
+static spinlock_t proc_lock = SPINLOCK_INIT("proc");
+
+static void queue_push(proc_queue_t *queue, proc_t *proc) {
+    proc->next = NULL;
+    proc->prev = queue->tail;
+    if (queue->tail != NULL) queue->tail->next = proc;
+    else queue->head = proc;
+    queue->tail = proc;
+}
+
+static void queue_remove(proc_queue_t *queue, proc_t *proc) {
+    if (proc->prev != NULL) proc->prev->next = proc->next;
+    else queue->head = proc->next;
+    if (proc->next != NULL) proc->next->prev = proc->prev;
+    else queue->tail = proc->prev;
+    proc->prev = NULL;
+    proc->next = NULL;
+}
+
+static sched_t *this_sched() {
+    return &scheds[smp_cpu_id()];
+}
+
+static int is_running(proc_t *proc) {
+    return scheds[proc->cpu].curr == proc;
+}
+
+// Goes on the run queue of proc->cpu.
+static void make_ready(proc_t *proc) {
+    sched_t *sched = &scheds[proc->cpu];
+    queue_push(&sched->run_queues[proc->priority], proc);
+    sched->ready_levels |= 1 << proc->priority;
+    sched->ready_count++;
+}
+
+static void unmake_ready(proc_t *proc) {
+    sched_t *sched = &scheds[proc->cpu];
+    proc_queue_t *queue = &sched->run_queues[proc->priority];
+    queue_remove(queue, proc);
+    if (queue->head == NULL) sched->ready_levels &= ~(1 << proc->priority);
+    sched->ready_count--;
+}
+
+// The first process of the highest priority that has any, which is the lowest set bit.
+static proc_t *take_next_ready(sched_t *sched) {
+    if (sched->ready_levels == 0) return NULL;
+
+    proc_t *proc = sched->run_queues[__builtin_ctz(sched->ready_levels)].head;
+    unmake_ready(proc);
+    return proc;
+}
+
+static uint32_t cpu_load(uint32_t cpu) {
+    return scheds[cpu].ready_count + (scheds[cpu].curr != NULL);
+}
+
+// The CPU with the least to do, `prefer` if nobody has less than that.
+static uint32_t pick_cpu(uint32_t prefer) {
+    uint32_t best = prefer;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (cpu_load(cpu) < cpu_load(best)) best = cpu;
+    }
+
+    return best;
+}
+
+// Queues the process on a CPU that has time for it, and gets that CPU to look at it if it
+// should run before whatever the CPU is doing, or if nothing is going to interrupt it.
+static void enqueue(proc_t *proc, uint32_t prefer) {
+    proc->cpu = pick_cpu(prefer);
+    make_ready(proc);
+
+    sched_t *sched = &scheds[proc->cpu];
+    if (sched->curr == NULL || sched->curr->priority > proc->priority || sched->ready_count == 1) {
+        // The timer is tickless, so it might not be armed for anything soon. Without an APIC
+        // there's no IPI either, but then this is the only CPU and its own timer can do it.
+        if (proc->cpu == smp_cpu_id()) timer_arm(timer_get_us());
+        else smp_send_resched(proc->cpu);
+    }
+}
 
-static proc_t *first_proc = NULL;
-static proc_t *curr_proc = NULL;
+// Takes the most important process from whichever other CPU has the most waiting.
+static int steal_work(sched_t *sched) {
+    sched_t *victim = NULL;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        sched_t *other = &scheds[cpu];
+        if (other == sched || other->ready_count == 0) continue;
+        if (victim == NULL || other->ready_count > victim->ready_count) victim = other;
+    }
 
-static uint32_t proc_i = 0;
-static volatile int sched_timer = -1;
-static volatile int is_modifying_procs = 0;
-static dangling_stack_t *dangling_stacks = NULL;
-static int is_first_schedule = 1;
+    if (victim == NULL) return 0;
+
+    proc_t *proc = take_next_ready(victim);
+    proc->cpu = sched - scheds;
+    make_ready(proc);
+    return 1;
+}
+
+static int grow_pid_table() {
+    uint32_t new_size = pid_table_size == 0 ? PID_TABLE_INITIAL : pid_table_size * 2;
+    pid_slot_t *new_table = vmalloc_zeroed(new_size * sizeof(pid_slot_t));
+    if (new_table == NULL) return 0;
+
+    if (pid_table != NULL) {
+        memcpy(new_table, pid_table, pid_table_size * sizeof(pid_slot_t));
+        vfree(pid_table, pid_table_size * sizeof(pid_slot_t));
+    }
+
+    pid_table = new_table;
+    pid_table_size = new_size;
+    return 1;
+}
+
+static uint32_t alloc_pid(proc_t *proc) {
+    uint32_t pid = pid_next_free;
+    if (pid != PID_NONE) {
+        pid_next_free = pid_table[pid].next_free;
+    } else {
+        if (pid_count == pid_table_size && !grow_pid_table()) return PID_NONE;
+        pid = pid_count++;
+    }
+
+    pid_table[pid].proc = proc;
+    proc->generation = ++pid_table[pid].generation;
+    return pid;
+}
+
+static void free_pid(uint32_t pid) {
+    pid_table[pid].proc = NULL;
+    pid_table[pid].next_free = pid_next_free;
+    pid_next_free = pid;
+}
 
 void proc_load(mb_info_t *mb_info) {
+    proc_cache = kmem_cache_create("proc_t", sizeof(proc_t));
+    // Slab objects are only 8 byte aligned, the extra bytes let fpu_state align it properly.
+    fpu_cache = kmem_cache_create("fpu_state", FPU_STATE_SIZE + FPU_STATE_ALIGN - 8);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        scheds[cpu].is_idle = 1;
+    }
+
     vga_printf("mb struct is at %p\n", mb_info);
     if (mb_info->flags.mods && mb_info->mods.count > 0) {
         mod_t *modules = mb_info->mods.addr + 0xc0000000 / sizeof(mod_t);
@@ -48,27 +268,65 @@ void proc_load(mb_info_t *mb_info) {
 }
 
 int_ctx_t *proc_get_current() {
-    if (curr_proc == NULL) panic("proc.c: proc_get_current called when no processes are active!");
-    return curr_proc->state;
+    proc_t *curr = this_sched()->curr;
+    if (curr == NULL) panic("proc.c: proc_get_current called when no processes are active!");
+    return curr->state;
+}
+
+proc_t *proc_get_current_proc() {
+    proc_t *curr = this_sched()->curr;
+    if (curr == NULL) panic("proc.c: proc_get_current_proc called when no processes are active!");
+    return curr;
+}
+
+// Sets up everything but the address space and the initial state.
+static proc_t *alloc_proc() {
+    proc_t *proc = kmem_cache_alloc_zeroed(proc_cache);
+    if (proc == NULL) return NULL;
+
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    proc->id = alloc_pid(proc);
+    spin_unlock_irqrestore(&proc_lock, flags);
+
+    if (proc->id == PID_NONE) {
+        kmem_cache_free(proc_cache, proc);
+        return NULL;
+    }
+
+    proc->status = PROC_RUNNABLE;
+    proc->priority = PRIO_DEFAULT;
+    proc->parent = PID_NONE;
+    proc->fpu_cpu = (uint32_t) -1;
+    proc->sleep_timer.fn = sleep_done;
+    proc->stack = virt_alloc_kernel_zeroed();
+    proc->state = (int_ctx_t *) (proc->stack + 4096 - sizeof(int_ctx_t));
+    return proc;
+}
+
+// Lines the process up to run after everything that's already runnable on the CPU with the
+// least to do.
+static void add_proc(proc_t *proc) {
+    proc->ready_since = timer_get_us();
+
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    enqueue(proc, smp_cpu_id());
+    spin_unlock_irqrestore(&proc_lock, flags);
 }
 
 proc_t *proc_new(void *entry) {
-    if (proc_i >= MAX_PROCS) panic("proc.c: max process count reached!\n");
+    proc_t *proc = alloc_proc();
+    if (proc == NULL) panic("proc.c: Couldn't allocate a process!\n");
 
-    proc_t *proc = virt_alloc_kernel();
-    memset(proc, 0, 4096);
-    proc->id = proc_i;
-    proc->stack = virt_alloc_kernel();
-    memset(proc->stack, 0, 4096);
     proc->vmm_ctx = virt_new_ctx();
+    proc->user_stack = virt_alloc_stack(proc->vmm_ctx);
+    if (proc->user_stack == NULL) panic("proc.c: Couldn't make a user stack!\n");
 
-    proc->state = (int_ctx_t *) (proc->stack + 4096 - sizeof(int_ctx_t));
-    proc->user_stack = virt_alloc(proc->vmm_ctx);
+    uint32_t stack_top = (uint32_t) proc->user_stack + USER_STACK_MAX;
     *proc->state = (int_ctx_t) {
         .edi = 0,
         .esi = 0,
-        .ebp = (uint32_t) proc->user_stack + 4096,
-        .esp = (uint32_t) proc->user_stack + 4096,
+        .ebp = stack_top,
+        .esp = stack_top,
         .ebx = 0,
         .edx = 0,
         .ecx = 0,
@@ -78,90 +336,441 @@ proc_t *proc_new(void *entry) {
         .eip = (uint32_t) entry,
         .cs = 0x1b,
         .eflags = 0x202,
-        .esp2 = (uint32_t) proc->user_stack + 4096,
+        .esp2 = stack_top,
         .ss = 0x23,
     };
 
-    while (is_modifying_procs) {}
-    is_modifying_procs = 1;
+    add_proc(proc);
+    return proc;
+}
+
+// Never supposed to happen, kernel threads don't have anywhere to return to.
+static void kernel_thread_returned() {
+    panic("proc.c: A kernel thread returned!\n");
+}
+
+proc_t *proc_new_kernel(void (*entry)(void *), void *arg) {
+    proc_t *proc = alloc_proc();
+    if (proc == NULL) return NULL;
+
+    // Interrupts of ring 0 code don't push esp and ss, so the last two fields of the frame
+    // are the top of the thread's stack instead, as if entry had just been called.
+    *proc->state = (int_ctx_t) {
+        .eip = (uint32_t) entry,
+        .cs = 0x08,
+        .eflags = 0x202,
+        .esp2 = (uint32_t) kernel_thread_returned,
+        .ss = (uint32_t) arg,
+    };
+
+    add_proc(proc);
+    return proc;
+}
+
+static void *fpu_state(proc_t *proc) {
+    return (void *) (((uint32_t) proc->fpu_area + FPU_STATE_ALIGN - 1) & ~(FPU_STATE_ALIGN - 1));
+}
 
-    if (first_proc == NULL) {
-        first_proc = proc;
-        curr_proc = proc;
+proc_t *proc_fork(int_ctx_t *ctx) {
+    proc_t *parent = this_sched()->curr;
+
+    // The child gets the same FPU state, if the parent has one. Whatever the parent did since
+    // it last got the CPU is only in the registers so far.
+    void *fpu_area = NULL;
+    if (parent->fpu_area != NULL) {
+        fpu_area = kmem_cache_alloc(fpu_cache);
+        if (fpu_area == NULL) return NULL;
+        if (fpu_is_enabled()) fpu_save(fpu_state(parent));
     }
 
-    curr_proc->next = proc;
-    proc->next = first_proc;
+    proc_t *child = alloc_proc();
+    if (child == NULL) {
+        if (fpu_area != NULL) kmem_cache_free(fpu_cache, fpu_area);
+        return NULL;
+    }
 
-    proc->prev = curr_proc;
-    first_proc->prev = proc;
+    child->fpu_area = fpu_area;
+    if (fpu_area != NULL) memcpy(fpu_state(child), fpu_state(parent), FPU_STATE_SIZE);
 
-    proc_i++;
+    child->vmm_ctx = virt_clone_ctx(parent->vmm_ctx);
+    child->user_stack = parent->user_stack;
+    child->priority = parent->priority;
+    child->parent = parent->id;
+    child->parent_generation = parent->generation;
 
-    is_modifying_procs = 0;
+    // The child continues right where the parent made the syscall, but sees 0 instead of its ID.
+    *child->state = *ctx;
+    child->state->eax = 0;
+
+    add_proc(child);
+    return child;
+}
+
+proc_t *proc_get(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    proc_t *proc = pid < pid_count ? pid_table[pid].proc : NULL;
+    spin_unlock_irqrestore(&proc_lock, flags);
+    return proc;
+}
+
+proc_t *proc_get_from(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    proc_t *proc = NULL;
+    for (; pid < pid_count && proc == NULL; pid++) {
+        proc = pid_table[pid].proc;
+    }
+    spin_unlock_irqrestore(&proc_lock, flags);
     return proc;
 }
 
+void proc_get_stats(proc_t *proc, proc_stats_t *stats) {
+    uint64_t now = timer_get_us();
+
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    *stats = (proc_stats_t) {
+        .pid = proc->id,
+        .state = PROC_STATS_WAITING,
+        .priority = proc->priority,
+        .cpu = proc->cpu,
+        .run_time = proc->run_time,
+        .ready_time = proc->ready_time,
+        .last_run = proc->last_run,
+        .now = now,
+        .voluntary_switches = proc->voluntary_switches,
+        .involuntary_switches = proc->involuntary_switches,
+        .is_kernel_thread = proc->vmm_ctx == NULL,
+        .max_wake_latency = max_wake_latency[proc->priority],
+    };
+
+    // Neither of those is charged until the process leaves the CPU or the run queue.
+    if (is_running(proc)) {
+        stats->state = PROC_STATS_RUNNING;
+        if (now > proc->last_run) stats->run_time += now - proc->last_run;
+    } else if (proc->status == PROC_RUNNABLE) {
+        stats->state = PROC_STATS_READY;
+        if (now > proc->ready_since) stats->ready_time += now - proc->ready_since;
+    }
+    spin_unlock_irqrestore(&proc_lock, flags);
+}
+
+// The proc_* functions below take proc_lock and call these.
+static void block(proc_t *proc) {
+    // Running processes aren't queued, the scheduler moves them once it switches away.
+    if (proc->status == PROC_RUNNABLE) {
+        proc->status = PROC_WAITING;
+        if (!is_running(proc)) {
+            unmake_ready(proc);
+            queue_push(&wait_queue, proc);
+        }
+    }
+}
+
+static void wake(proc_t *proc) {
+    if (proc->status == PROC_WAITING) {
+        // Woken up early, it shouldn't be woken up again later.
+        timer_del(&proc->sleep_timer);
+
+        proc->status = PROC_RUNNABLE;
+        proc->woken_at = proc->ready_since = timer_get_us();
+        // It might not even have been switched away from yet. Otherwise, the CPU it ran on
+        // last probably still has some of its memory cached, if it isn't too busy.
+        if (!is_running(proc)) {
+            queue_remove(&wait_queue, proc);
+            enqueue(proc, proc->cpu);
+        }
+    }
+}
+
+void proc_block(proc_t *proc) {
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    block(proc);
+    spin_unlock_irqrestore(&proc_lock, flags);
+}
+
+void proc_wake(proc_t *proc) {
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    wake(proc);
+    spin_unlock_irqrestore(&proc_lock, flags);
+}
+
+void proc_sleep(proc_t *proc, uint32_t ms) {
+    if (ms == 0) return;
+
+    uint64_t wake_at = timer_get_us() + (uint64_t) ms * 1000;
+
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    timer_add(&proc->sleep_timer, wake_at);
+    block(proc);
+    spin_unlock_irqrestore(&proc_lock, flags);
+}
+
+static void sleep_done(timer_t *timer) {
+    proc_wake((proc_t *) ((void *) timer - offsetof(proc_t, sleep_timer)));
+}
+
+int proc_set_priority(proc_t *proc, uint32_t priority) {
+    if (priority >= PRIO_COUNT) return -1;
+
+    // Queued processes move over to their new level right away, running ones when they're
+    // switched away from.
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    int is_ready = !is_running(proc) && proc->status == PROC_RUNNABLE;
+    if (is_ready) unmake_ready(proc);
+    proc->priority = priority;
+    if (is_ready) make_ready(proc);
+    spin_unlock_irqrestore(&proc_lock, flags);
+    return 0;
+}
+
+int proc_may_set_priority(proc_t *caller, proc_t *proc, uint32_t priority) {
+    // The parent might be long gone, with some other process having its ID now.
+    int is_child = proc->parent == caller->id && proc->parent_generation == caller->generation;
+    if (proc != caller && !is_child) return 0;
+    return priority >= caller->priority;
+}
+
+uint32_t proc_get_priority(proc_t *proc) {
+    return proc->priority;
+}
+
+uint32_t proc_get_id(proc_t *proc) {
+    return proc->id;
+}
+
 vmm_ctx_t *proc_get_vmm_ctx(proc_t *proc) {
     return proc->vmm_ctx;
 }
 
-int_ctx_t *proc_schedule(int_ctx_t *ctx) {
-    if (is_modifying_procs) return ctx;
+// When proc_schedule has to run again on this CPU at the latest, in us.
+static uint64_t next_deadline(sched_t *sched) {
+    uint64_t deadline = (uint64_t) -1;
+
+    // A process that's alone can keep running, nobody has to take the CPU away from it.
+    // Sleepers are up to the BSP's timer_arm, which knows when their timers run out.
+    if (sched->curr != NULL && sched->ready_levels != 0) deadline = sched->slice_end;
+
+    return deadline;
+}
+
+// Registers of a process that used the FPU during its turn are newer than what's saved, and
+// it might run on another CPU next, so they're saved right away. Loading them again is what
+// waits for the #NM, and only if some other process used the FPU in the meantime.
+static void switch_fpu(sched_t *sched, proc_t *prev, proc_t *next) {
+    if (prev != NULL && fpu_is_enabled()) fpu_save(fpu_state(prev));
+
+    uint32_t cpu = sched - scheds;
+    if (next != NULL && next == sched->fpu_owner && next->fpu_cpu == cpu) fpu_enable();
+    else fpu_disable();
+}
+
+int proc_handle_fpu_trap() {
+    sched_t *sched = this_sched();
+    proc_t *curr = sched->curr;
+
+    // The kernel itself never touches the FPU.
+    if (curr == NULL || curr->vmm_ctx == NULL || !fpu_is_present()) return 0;
+
+    if (curr->fpu_area == NULL) {
+        curr->fpu_area = kmem_cache_alloc(fpu_cache);
+        if (curr->fpu_area == NULL) return 0;
+        fpu_init_state(fpu_state(curr));
+    }
+
+    fpu_enable();
+
+    uint32_t cpu = sched - scheds;
+    if (sched->fpu_owner != curr || curr->fpu_cpu != cpu) {
+        fpu_restore(fpu_state(curr));
+        sched->fpu_owner = curr;
+        curr->fpu_cpu = cpu;
+    }
 
-    if (curr_proc == NULL) {
-        // No processes were added yet
-        vga_printf("No procs!\n");
-        while (1);
+    return 1;
+}
+
+static int_ctx_t *switch_procs(int_ctx_t *ctx, uint64_t now) {
+    sched_t *sched = this_sched();
+    proc_t *curr = sched->curr;
+    int is_yielding = sched->is_yielding;
+    sched->is_yielding = 0;
+
+    // Nothing else to do here, but maybe some other CPU has more than it can handle.
+    if (sched->ready_levels == 0 && (curr == NULL || curr->status != PROC_RUNNABLE)) steal_work(sched);
+
+    if (curr == NULL && sched->is_idle && sched->ready_levels == 0) {
+        // Still nothing to do
         return ctx;
-    } else if (sched_timer > -1 && !timer_oneshot_is_done(sched_timer)) {
-        // Time isn't up for this process
+    } else if (curr != NULL && curr->status == PROC_RUNNABLE && now < sched->slice_end
+               && (sched->ready_levels & ((1 << curr->priority) - 1)) == 0) {
+        // Time isn't up for this process, and nothing more important wants to run
         return ctx;
-    } else if (!is_first_schedule) {
-        curr_proc->state = ctx;
-    } else {
-        is_first_schedule = 0;
     }
 
-    sched_timer = timer_new_oneshot(10);
+    // Right after an exit, ctx belongs to a process that's gone.
+    if (curr != NULL) {
+        curr->state = ctx;
+        curr->run_time += now - curr->last_run;
+        if (curr->status == PROC_RUNNABLE) {
+            make_ready(curr);
+            curr->ready_since = now;
+        } else {
+            queue_push(&wait_queue, curr);
+        }
+    } else if (sched->is_idle) {
+        sched->idle_state = ctx;
+    }
+
+    proc_t *next = take_next_ready(sched);
+    switch_fpu(sched, curr, next);
 
-    curr_proc = curr_proc->next;
+    // Picking the same process again isn't a switch.
+    if (curr != NULL && curr != next) {
+        if (curr->status != PROC_RUNNABLE || is_yielding) curr->voluntary_switches++;
+        else curr->involuntary_switches++;
+    }
 
-    virt_use(curr_proc->vmm_ctx);
-    gdt_set_kernel_stack(curr_proc->state + 1);
+    curr = sched->curr = next;
+    sched->is_idle = curr == NULL;
+    if (sched->is_idle) return sched->idle_state;
 
-    return curr_proc->state;
+    curr->last_run = now;
+    if (now > curr->ready_since) curr->ready_time += now - curr->ready_since;
+
+    if (curr->woken_at != 0) {
+        uint32_t latency = now - curr->woken_at;
+        if (latency > max_wake_latency[curr->priority]) max_wake_latency[curr->priority] = latency;
+        curr->woken_at = 0;
+    }
+
+    sched->slice_end = now + (uint64_t) quantum_ms[curr->priority] * 1000;
+
+    // Kernel threads make do with whatever context is loaded, the kernel half is the same
+    // in all of them. They never leave ring 0, so they don't need the TSS either.
+    if (curr->vmm_ctx != NULL) {
+        virt_use(curr->vmm_ctx);
+        gdt_set_kernel_stack(curr->state + 1);
+    }
+
+    return curr->state;
 }
 
-void proc_exit_current() {
-    while (is_modifying_procs) {}
-    is_modifying_procs = 1;
+int_ctx_t *proc_schedule(int_ctx_t *ctx) {
+    uint64_t now = timer_get_us();
 
-    proc_t *curr = curr_proc;
-    proc_t *next = curr->next;
-    proc_t *prev = curr->prev;
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    ctx = switch_procs(ctx, now);
+    uint64_t deadline = next_deadline(this_sched());
+    spin_unlock_irqrestore(&proc_lock, flags);
 
-    if (next == curr) {
-        curr_proc = NULL;
-    } else {
-        next->prev = prev;
-        prev->next = next;
-        curr_proc = next;
+    timer_arm(deadline);
+    return ctx;
+}
+
+int_ctx_t *proc_handle_yield(int_ctx_t *ctx) {
+    this_sched()->slice_end = 0;
+    this_sched()->is_yielding = 1;
+    return proc_schedule(ctx);
+}
+
+void proc_yield() {
+    asm volatile ("int %0" :: "i" (PROC_YIELD_VECTOR) : "memory");
+}
+
+// Whether some other CPU has processes waiting that this one could take.
+static int has_stealable_work() {
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (cpu != smp_cpu_id() && scheds[cpu].ready_count != 0) return 1;
     }
 
-    virt_free(curr->vmm_ctx, curr->user_stack);
-    dangling_stack_t *dangling_stack = curr->stack;
-    dangling_stack->next = dangling_stacks == NULL ? NULL : dangling_stacks;
-    dangling_stacks = dangling_stack;
+    return 0;
+}
+
+void proc_idle() {
+    while (1) {
+        // Interrupts take the kernel lock too, so they have to wait until we're done.
+        asm volatile ("cli");
+        smp_lock_kernel();
+
+        int has_work = phys_refill_zeroed();
+        // The scheduler takes it off the other CPU.
+        if (has_stealable_work()) smp_send_resched(smp_cpu_id());
 
-    virt_destroy_ctx(curr->vmm_ctx, 1);
-    virt_free_kernel(curr);
+        smp_unlock_kernel();
 
-    is_first_schedule = 1;
+        // An interrupt is the only thing that can give us more work, so wait for one. sti only
+        // takes effect after the next instruction, so none can slip in before the hlt.
+        if (has_work) asm volatile ("sti");
+        else asm volatile ("sti; hlt");
+    }
+}
+
+// Frees a bit of what exited processes left behind, and comes back later for the rest.
+static void reap(work_t *work) {
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    proc_t *proc = dead_procs;
+    spin_unlock_irqrestore(&proc_lock, flags);
+    if (proc == NULL) return;
+
+    if (proc->vmm_ctx != NULL) {
+        if (!virt_reap_ctx(proc->vmm_ctx, &proc->reclaimed)) {
+            work_post(work_get_default_queue(), work);
+            return;
+        }
+        proc->vmm_ctx = NULL;
+    }
 
-    is_modifying_procs = 0;
-    
-    asm volatile ("sti");
+    // The CPU it exited on held the kernel lock until it was off this stack.
+    virt_free_kernel(proc->stack);
+    proc->reclaimed++;
+    if (proc->fpu_area != NULL) kmem_cache_free(fpu_cache, proc->fpu_area);
 
-    while(1);
+    flags = spin_lock_irqsave(&proc_lock);
+
+    // Nothing can refer to it anymore, so the ID is up for grabs again.
+    free_pid(proc->id);
+
+    // More processes might have exited in the meantime, in front of it.
+    proc_t **link = &dead_procs;
+    while (*link != proc) link = &(*link)->next;
+    *link = proc->next;
+    int has_more = dead_procs != NULL;
+
+    reclaimed_frames += proc->reclaimed;
+    spin_unlock_irqrestore(&proc_lock, flags);
+
+    vga_printf("proc.c: Process %d reclaimed %u frames (%u total)\n", proc->id, proc->reclaimed, reclaimed_frames);
+    kmem_cache_free(proc_cache, proc);
+
+    if (has_more) work_post(work_get_default_queue(), work);
+}
+
+uint32_t proc_get_reclaimed_frames() {
+    return reclaimed_frames;
+}
+
+void proc_exit_current() {
+    sched_t *sched = this_sched();
+    proc_t *curr = sched->curr;
+
+    // Lookups fail from now on, but the ID stays taken until reap is done with it.
+    uint32_t flags = spin_lock_irqsave(&proc_lock);
+    sched->curr = NULL;
+    curr->status = PROC_DEAD;
+    pid_table[curr->id].proc = NULL;
+    spin_unlock_irqrestore(&proc_lock, flags);
+
+    // Whatever it shared stays mapped wherever else it is, the frames know who still uses them.
+    shm_release(curr->id);
+
+    // Idle CPUs and kernel threads would otherwise keep it loaded, and it couldn't be freed.
+    virt_abandon_ctx(curr->vmm_ctx);
+    if (sched->fpu_owner == curr) sched->fpu_owner = NULL;
+
+    // Freeing everything takes a while, and we're still on this process' kernel stack
+    // anyway. A kernel thread takes care of it later.
+    flags = spin_lock_irqsave(&proc_lock);
+    curr->next = dead_procs;
+    dead_procs = curr;
+    spin_unlock_irqrestore(&proc_lock, flags);
+    work_post(work_get_default_queue(), &reap_work);
 }
@@ -5,14 +5,86 @@
 #include "../multiboot.h"
 #include "../mem/virt.h"
 
+// Priority levels, 0 is the most important one. Whatever is runnable at the highest level
+// gets the CPU, round-robin between processes on the same level.
+#define PRIO_COUNT   8
+#define PRIO_DEFAULT 4
+
+// Kernel threads use this to get into the scheduler, see proc_yield.
+#define PROC_YIELD_VECTOR 0x68
+
 typedef struct proc_t proc_t;
 
+// What proc_get_stats says a process is doing.
+#define PROC_STATS_RUNNING 0
+#define PROC_STATS_READY   1 // Waiting for a CPU
+#define PROC_STATS_WAITING 2 // Blocked or asleep
+
+// Where a process' time went. All times are in us. User programs get a copy of this through
+// SYSCALL_PROC_STATS, so the layout must stay the same.
+typedef struct {
+    uint32_t pid;
+    uint32_t state;
+    uint32_t priority;
+    uint32_t cpu;                   // Which CPU runs it, or whose run queue it's on
+    uint64_t run_time;              // On a CPU, including the current turn
+    uint64_t ready_time;            // Runnable, but waiting for a CPU
+    uint64_t last_run;              // When it last got a CPU, 0 if it never did
+    uint64_t now;                   // When these stats were taken
+    uint32_t voluntary_switches;    // It blocked, slept or yielded
+    uint32_t involuntary_switches;  // It was preempted
+    uint32_t is_kernel_thread;
+    uint32_t max_wake_latency;      // Worst from proc_wake to a CPU so far, for its priority
+} proc_stats_t;
+
 void proc_load(mb_info_t *mb_info);
 int_ctx_t *proc_get_current();
+proc_t *proc_get_current_proc();
 int_ctx_t *proc_schedule(int_ctx_t *ctx);
 
 proc_t *proc_new(void *entry);
+// Starts a kernel thread that runs entry(arg), which must never return. It only ever uses the
+// kernel half, so switching to it doesn't touch CR3. It runs with interrupts on and without
+// the kernel lock, so it has to take that itself, with interrupts off.
+// Returns NULL if there's no room for another process.
+proc_t *proc_new_kernel(void (*entry)(void *), void *arg);
+// Returns NULL if there's no room for another process.
+proc_t *proc_fork(int_ctx_t *ctx);
+// Returns NULL if no live process has that ID.
+proc_t *proc_get(uint32_t pid);
+// The live process with the lowest ID that's at least pid, or NULL. For going through all of them.
+proc_t *proc_get_from(uint32_t pid);
+void proc_get_stats(proc_t *proc, proc_stats_t *stats);
+uint32_t proc_get_id(proc_t *proc);
+// Moves a process to the wait queue, where the scheduler leaves it alone until proc_wake.
+// Blocking the running process takes effect the next time proc_schedule runs.
+void proc_block(proc_t *proc);
+void proc_wake(proc_t *proc);
+// Blocks the process for at least ms milliseconds, until a timer wakes it up. For the
+// running process, that means it should call proc_schedule, or proc_yield in a kernel thread.
+void proc_sleep(proc_t *proc, uint32_t ms);
+// Returns 0 on success, -1 if priority is out of range.
+int proc_set_priority(proc_t *proc, uint32_t priority);
+// Whether caller gets to give proc that priority. Processes can only change themselves and
+// their children, and never to a higher priority than their own.
+int proc_may_set_priority(proc_t *caller, proc_t *proc, uint32_t priority);
+uint32_t proc_get_priority(proc_t *proc);
 vmm_ctx_t *proc_get_vmm_ctx(proc_t *proc);
+// Gives up the CPU from a kernel thread, until its next turn. A thread that blocked itself
+// with proc_block only comes back after proc_wake. The kernel lock must not be held.
+void proc_yield();
+// What the #NM handler does: lets the running process use the FPU, with its own state in
+// it. Returns 0 if it can't, e.g. because it's a kernel thread.
+int proc_handle_fpu_trap();
+// What the PROC_YIELD_VECTOR interrupt does: proc_schedule, without the rest of the slice.
+int_ctx_t *proc_handle_yield(int_ctx_t *ctx);
+// The caller has to get off the process with proc_schedule right after. What it leaves
+// behind gets freed a bit at a time, by a kernel thread.
 void proc_exit_current();
+// Where the boot code ends up. Zeroes pages while nothing else wants to run, and halts the
+// CPU once it's out of things to do.
+void proc_idle();
+// Frames freed by exited processes since boot.
+uint32_t proc_get_reclaimed_frames();
 
 #endif
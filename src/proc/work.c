@@ -0,0 +1,82 @@
+#include "work.h"
+
+#include <stddef.h>
+
+#include "../mem/slab.h"
+#include "../misc.h"
+#include "../x86/smp.h"
+#include "proc.h"
+
+struct work_queue_t {
+    work_t *head;
+    work_t *tail;
+    proc_t *thread;
+};
+
+static kmem_cache_t *queue_cache = NULL;
+static work_queue_t *default_queue = NULL;
+
+static void worker(void *arg) {
+    work_queue_t *queue = arg;
+
+    while (1) {
+        asm volatile ("cli");
+        smp_lock_kernel();
+
+        work_t *work = queue->head;
+        if (work != NULL) {
+            queue->head = work->next;
+            if (queue->head == NULL) queue->tail = NULL;
+            work->next = NULL;
+            work->is_queued = 0;
+
+            work->fn(work);
+        } else {
+            // work_post wakes us up again. If that happens before the yield, we just keep going.
+            proc_block(queue->thread);
+        }
+
+        smp_unlock_kernel();
+
+        if (work == NULL) proc_yield();
+
+        // sti only takes effect after the next instruction, without the nop that'd be the cli.
+        asm volatile ("sti; nop");
+    }
+}
+
+void work_init() {
+    queue_cache = kmem_cache_create("work_queue_t", sizeof(work_queue_t));
+    default_queue = work_queue_create(PRIO_DEFAULT);
+    if (default_queue == NULL) panic("work.c: Couldn't make the default work queue!\n");
+}
+
+work_queue_t *work_get_default_queue() {
+    return default_queue;
+}
+
+work_queue_t *work_queue_create(uint32_t priority) {
+    work_queue_t *queue = kmem_cache_alloc_zeroed(queue_cache);
+    if (queue == NULL) return NULL;
+
+    queue->thread = proc_new_kernel(worker, queue);
+    if (queue->thread == NULL) {
+        kmem_cache_free(queue_cache, queue);
+        return NULL;
+    }
+
+    proc_set_priority(queue->thread, priority);
+    return queue;
+}
+
+void work_post(work_queue_t *queue, work_t *work) {
+    if (work->is_queued) return;
+
+    work->is_queued = 1;
+    work->next = NULL;
+    if (queue->tail != NULL) queue->tail->next = work;
+    else queue->head = work;
+    queue->tail = work;
+
+    proc_wake(queue->thread);
+}
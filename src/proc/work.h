@@ -0,0 +1,30 @@
+#ifndef WORK_H
+#define WORK_H
+
+#include <stdint.h>
+
+// A piece of work for later. It's meant to be part of whatever it works on, so posting it
+// never has to allocate anything, and can happen in an interrupt handler.
+typedef struct work_t {
+    void (*fn)(struct work_t *work);
+    struct work_t *next;
+    int is_queued;
+} work_t;
+
+typedef struct work_queue_t work_queue_t;
+
+// Makes the default queue. Needs proc_load to have run.
+void work_init();
+// For things that don't need a queue of their own.
+work_queue_t *work_get_default_queue();
+// Every queue has its own kernel thread, which runs at the given priority.
+// Returns NULL on failure.
+work_queue_t *work_queue_create(uint32_t priority);
+
+// Makes the queue's thread run work->fn soon, after everything posted before. Work runs with
+// the kernel lock held and interrupts off, just like an interrupt handler, but the thread
+// lets everything else in between two of them. Posting work that's still queued does nothing.
+// fn can post its own work again, e.g. to do a little more next time.
+void work_post(work_queue_t *queue, work_t *work);
+
+#endif
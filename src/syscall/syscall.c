@@ -1,17 +1,75 @@
 #include "syscall.h"
 
+#include "../ipc/shm.h"
 #include "../proc/proc.h"
 #include "../io/vga.h"
+#include "../misc.h"
 
 int_ctx_t *syscall_handle(int_ctx_t *ctx) {
     switch (ctx->eax) {
     case SYSCALL_EXIT:
         proc_exit_current();
-        return proc_get_current();
+        return proc_schedule(ctx);
     case SYSCALL_WRITE:
         vga_set_color(ctx->ebx >> 8);
         vga_putc(ctx->ebx & 0xff);
         return ctx;
+    case SYSCALL_FORK: {
+        proc_t *child = proc_fork(ctx);
+        ctx->eax = child == NULL ? (uint32_t) -1 : proc_get_id(child);
+        return ctx;
+    }
+    case SYSCALL_ALLOC: {
+        // ebx is the size in bytes, ecx the ALLOC_* flags. eax gets the address, or 0.
+        uint32_t flags = (ctx->ecx & ALLOC_LARGE) ? VIRT_REGION_LARGE : 0;
+        vmm_ctx_t *vmm_ctx = proc_get_vmm_ctx(proc_get_current_proc());
+        ctx->eax = (uint32_t) virt_alloc_region(vmm_ctx, ctx->ebx, flags);
+        return ctx;
+    }
+    case SYSCALL_SHM_CREATE:
+        // ebx is the size in bytes. eax gets the region's ID, or -1.
+        ctx->eax = shm_create(proc_get_id(proc_get_current_proc()), ctx->ebx);
+        return ctx;
+    case SYSCALL_SHM_GRANT:
+        // ebx is the region's ID, ecx the process to grant it to, edx the SHM_* rights. eax gets 0, or -1.
+        if (proc_get(ctx->ecx) == NULL) ctx->eax = -1;
+        else ctx->eax = shm_grant(ctx->ebx, proc_get_id(proc_get_current_proc()), ctx->ecx, ctx->edx);
+        return ctx;
+    case SYSCALL_SHM_MAP: {
+        // ebx is the region's ID. eax gets the address it was mapped at, or 0.
+        proc_t *proc = proc_get_current_proc();
+        ctx->eax = (uint32_t) shm_map(ctx->ebx, proc_get_id(proc), proc_get_vmm_ctx(proc));
+        return ctx;
+    }
+    case SYSCALL_SET_PRIO: {
+        // ebx is the process, ecx the new priority, 0 being the highest. eax gets 0, or -1.
+        proc_t *proc = proc_get(ctx->ebx);
+        if (proc == NULL || !proc_may_set_priority(proc_get_current_proc(), proc, ctx->ecx)) ctx->eax = -1;
+        else ctx->eax = proc_set_priority(proc, ctx->ecx);
+        return ctx;
+    }
+    case SYSCALL_SLEEP:
+        // ebx is the time in ms. Some other process gets to run in the meantime.
+        proc_sleep(proc_get_current_proc(), ctx->ebx);
+        return proc_schedule(ctx);
+    case SYSCALL_PROC_STATS: {
+        // ebx is a process ID, ecx where the proc_stats_t goes. The stats are for the first live
+        // process whose ID is at least ebx, so going through all of them is easy. eax gets its
+        // ID, or -1 if there's none or ecx isn't writable.
+        proc_t *proc = proc_get_from(ctx->ebx);
+        proc_stats_t stats;
+        if (proc != NULL) proc_get_stats(proc, &stats);
+
+        if (proc == NULL || !virt_copy_to_user((void *) ctx->ecx, &stats, sizeof(stats))) ctx->eax = -1;
+        else ctx->eax = stats.pid;
+        return ctx;
+    }
+    case SYSCALL_FREE: {
+        // ebx is what SYSCALL_ALLOC returned, ecx the size it was given. eax gets 0, or -1.
+        vmm_ctx_t *vmm_ctx = proc_get_vmm_ctx(proc_get_current_proc());
+        ctx->eax = virt_free_user_range(vmm_ctx, (void *) ctx->ebx, ctx->ecx) ? 0 : -1;
+        return ctx;
+    }
     default:
         return ctx;
     }
@@ -5,6 +5,18 @@
 
 #define SYSCALL_EXIT        0x00
 #define SYSCALL_WRITE       0x01
+#define SYSCALL_FORK        0x02
+#define SYSCALL_ALLOC       0x03
+#define SYSCALL_SHM_CREATE  0x04
+#define SYSCALL_SHM_GRANT   0x05
+#define SYSCALL_SHM_MAP     0x06
+#define SYSCALL_SET_PRIO    0x07
+#define SYSCALL_SLEEP       0x08
+#define SYSCALL_PROC_STATS  0x09
+#define SYSCALL_FREE        0x0a
+
+// Flags for SYSCALL_ALLOC
+#define ALLOC_LARGE         0x01 // Use large pages (4MiB, or 2MiB with PAE) where possible
 
 int_ctx_t *syscall_handle(int_ctx_t *ctx);
 
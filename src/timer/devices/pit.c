@@ -25,19 +25,52 @@
 #define PIT_BINARY      0
 #define PIT_BCD         1
 
-#define PIT_FREQ        1193181 // in Hz
+// For some reason, QEMU really hates values below 8. :(
+// A bit more than that also keeps us from drowning in interrupts for deadlines that are
+// basically now anyways. This is ~100us.
+#define PIT_MIN_COUNT   120
+// After hitting 0, the counter wraps around and keeps counting down from 0xffff. Capping
+// countdowns at half of that means a count above the armed one is always a wrapped one,
+// as long as nobody takes ~27ms to look at it.
+#define PIT_MAX_COUNT   0x8000
 
-uint64_t pit_init(uint32_t) {
-    // For some reason, QEMU really hates values below 8. :(
-    // So we just try to aim for more or less 1ms instead of going for microseconds.
-    // This is ~1.0007ms, so it's pretty close. We could do funny fractional stuff,
-    // but honestly, it's good enough. The PIT isn't very stable anyways, at least
-    // not in QEMU.
-    uint16_t pit_count = 1194;
+static uint64_t elapsed_base = 0;   // PIT cycles before the current countdown started
+static uint16_t armed_count = 0;
 
-    outb(PIT_CMD, PIT_CH0 | PIT_ACC_LOHI | PIT_RATE_GEN | PIT_BINARY);
-    outb(PIT_DATA_CH0, pit_count & 0xff);
-    outb(PIT_DATA_CH0, (pit_count >> 8) & 0xff);
+static uint16_t read_count() {
+    outb(PIT_CMD, PIT_CH0 | PIT_ACC_LATCH);
+    uint16_t count = inb(PIT_DATA_CH0);
+    count |= inb(PIT_DATA_CH0) << 8;
+    return count;
+}
+
+// How far the current countdown is along, even if it has run out already.
+static uint32_t countdown_elapsed() {
+    uint16_t count = read_count();
+    if (count <= armed_count) return armed_count - count;
+    return armed_count + (0x10000 - count);
+}
+
+static void start_countdown(uint16_t count) {
+    armed_count = count;
+    outb(PIT_CMD, PIT_CH0 | PIT_ACC_LOHI | PIT_INT_ON_TC | PIT_BINARY);
+    outb(PIT_DATA_CH0, count & 0xff);
+    outb(PIT_DATA_CH0, (count >> 8) & 0xff);
+}
+
+void pit_init() {
+    elapsed_base = 0;
+    start_countdown(PIT_MAX_COUNT);
+}
+
+void pit_arm(uint64_t ticks) {
+    if (ticks < PIT_MIN_COUNT) ticks = PIT_MIN_COUNT;
+    if (ticks > PIT_MAX_COUNT) ticks = PIT_MAX_COUNT;
+
+    elapsed_base += countdown_elapsed();
+    start_countdown(ticks);
+}
 
-    return (uint64_t) pit_count * 1000000 / PIT_FREQ;
+uint64_t pit_get_ticks() {
+    return elapsed_base + countdown_elapsed();
 }
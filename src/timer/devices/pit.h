@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
-uint64_t pit_init(uint32_t us_between);
+#define PIT_FREQ        1193181 // in Hz
+
+// Starts the first countdown. From then on, the PIT only interrupts when it's told to.
+void pit_init();
+// Makes the PIT interrupt once, after `ticks` cycles of PIT_FREQ. Too short or too long
+// countdowns get clamped to what the PIT can do.
+void pit_arm(uint64_t ticks);
+// PIT cycles since pit_init, read from the counter itself.
+uint64_t pit_get_ticks();
 
 #endif
@@ -5,34 +5,46 @@
 #include "../misc.h"
 #include "../io/vga.h"
 #include "devices/pit.h"
-
-typedef struct timer_t {
-    int id;
-    uint64_t end;
-} timer_t;
+#include "../x86/apic.h"
+#include "../x86/smp.h"
+#include "../x86/spinlock.h"
+
+// Pending timers sit in a hierarchical timing wheel. Time is cut into ticks of TICK_US, and
+// each level has WHEEL_SLOTS slots, every one of them covering WHEEL_SLOTS times as many
+// ticks as one slot of the level below. A timer goes into the lowest level that reaches far
+// enough, so adding and removing one is O(1). Whenever the lowest level wraps around, the next
+// slot of the level above gets spread over it, which is the only time timers move.
+#define TICK_SHIFT  10 // A tick is ~1ms
+#define TICK_US     (1 << TICK_SHIFT)
+#define WHEEL_BITS  6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+// Timers further out than the wheel reaches (~4.8 hours) wait in its last slot, and get
+// moved down as far as they can go whenever it's their turn.
+#define WHEEL_MAX_TICKS ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
 
 static int timer_type;
-static uint64_t us_per_tick;
 
-static volatile uint64_t timer_ticks = 0;
-static int curr_timer_id = 1;
-static timer_t timers[MAX_TIMER_COUNT];
+// When the timer is going to interrupt next, in us.
+static uint64_t armed_deadline = 0;
 
-static timer_t *find_timer(int id) {
-    for (int i = 0; i < MAX_TIMER_COUNT; i++) {
-        if (timers[i].id == id) return &timers[i];
-    }
+static timer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+// Everything before this tick has run already.
+static uint32_t wheel_tick = 0;
+static uint32_t pending_count = 0;
 
-    return NULL;
-}
+// Covers the wheel and the PIT. Every CPU reads the time from it, and reading it takes a few
+// port accesses in a row that must not get mixed up with someone else's.
+static spinlock_t timer_lock = SPINLOCK_INIT("timer");
 
-void timer_init(int the_timer_type, uint32_t us_between) {
+void timer_init(int the_timer_type) {
     timer_type = the_timer_type;
-    memset(timers, 0, sizeof(timers));
+    memset(wheel, 0, sizeof(wheel));
 
     switch (timer_type) {
     case TIMER_PIT:
-        us_per_tick = pit_init(us_between);
+        pit_init();
         break;
     default:
         panic("timer.c: Unknown timer type 0x%2x!\n", timer_type);
@@ -43,36 +55,152 @@ int timer_get_type() {
     return timer_type;
 }
 
-void timer_tick() {
-    timer_ticks++;
+static uint64_t get_us() {
+    return pit_get_ticks() * 1000000 / PIT_FREQ;
+}
+
+uint64_t timer_get_us() {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    uint64_t us = get_us();
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return us;
+}
+
+static void program(uint64_t deadline, uint64_t now) {
+    armed_deadline = deadline;
+
+    // No timer can wait a whole second anyways, this just keeps the math from overflowing.
+    uint64_t us = deadline > now ? deadline - now : 0;
+    if (us > 1000000) us = 1000000;
+    pit_arm(us * PIT_FREQ / 1000000);
+}
+
+static void unlink(timer_t *timer) {
+    if (timer->prev != NULL) timer->prev->next = timer->next;
+    else *timer->slot = timer->next;
+    if (timer->next != NULL) timer->next->prev = timer->prev;
+
+    timer->slot = NULL;
+    pending_count--;
 }
 
-int timer_new_oneshot(uint32_t ms) {
-    timer_t *free_slot = find_timer(0);
-    if (free_slot == NULL) {
-        panic("timer.c: Failed to find free timer slot!\n");
+// Timers that are already due go into the slot that runs next.
+static void place(timer_t *timer) {
+    // Rounded up, a timer never runs early.
+    uint64_t tick = (timer->expires + TICK_US - 1) >> TICK_SHIFT;
+    uint64_t delta = tick > wheel_tick ? tick - wheel_tick : 0;
+    if (delta > WHEEL_MAX_TICKS) delta = WHEEL_MAX_TICKS;
+    timer->tick = wheel_tick + delta;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1u << (WHEEL_BITS * (level + 1)))) level++;
+
+    timer_t **slot = &wheel[level][(timer->tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) (*slot)->prev = timer;
+    *slot = timer;
+    pending_count++;
+}
+
+// Spreads the slot of `level` that's up next over the levels below it.
+static void cascade(int level) {
+    timer_t *timer = wheel[level][(wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    while (timer != NULL) {
+        timer_t *next = timer->next;
+        unlink(timer);
+        place(timer);
+        timer = next;
     }
+}
+
+// When the earliest pending timer is due, in us. Only looks through the lowest level. If
+// that's empty, it's when the next cascade might fill it, which the timer has to wake up for
+// anyways.
+static uint64_t next_expiry() {
+    if (pending_count == 0) return (uint64_t) -1;
 
-    free_slot->id = curr_timer_id++;
-    free_slot->end = timer_ticks + (uint64_t) ms * 1000 / us_per_tick;
-    return free_slot->id;
+    uint32_t tick = wheel_tick;
+    do {
+        if (wheel[0][tick & WHEEL_MASK] != NULL) break;
+        tick++;
+    } while (tick & WHEEL_MASK);
+
+    return (uint64_t) tick << TICK_SHIFT;
 }
 
-int timer_oneshot_is_done(int timer_id) {
-    timer_t *timer = find_timer(timer_id);
-    if (timer == NULL) {
-        panic("timer.c: No timer with id %d!\n", timer_id);
+void timer_arm(uint64_t deadline) {
+    // The PIT only interrupts the BSP, the others have their local APIC's timer. They're only
+    // ever armed for the scheduler, and don't need to be when there's nothing to wait for.
+    if (smp_cpu_id() != 0) {
+        if (deadline == (uint64_t) -1) return;
+
+        uint64_t now = timer_get_us();
+        uint64_t us = deadline > now ? deadline - now : 0;
+        apic_timer_arm(us > 1000000 ? 1000000 : us);
+        return;
     }
 
-    if (timer->end > timer_ticks) return 0;
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    uint64_t expiry = next_expiry();
+    program(expiry < deadline ? expiry : deadline, get_us());
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void timer_add(timer_t *timer, uint64_t expires) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    if (timer->slot != NULL) unlink(timer);
+    timer->expires = expires;
+    place(timer);
+
+    // Whoever adds it might not be the BSP, which could be waiting for something later.
+    uint64_t expiry = (uint64_t) timer->tick << TICK_SHIFT;
+    if (expiry < armed_deadline) program(expiry, get_us());
+
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void timer_del(timer_t *timer) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    if (timer->slot != NULL) unlink(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// The next timer that's due by now, or NULL. Moves the wheel along as far as now.
+static timer_t *take_expired(uint64_t now) {
+    while (((uint64_t) wheel_tick << TICK_SHIFT) <= now) {
+        timer_t *timer = wheel[0][wheel_tick & WHEEL_MASK];
+        if (timer != NULL) {
+            unlink(timer);
+            return timer;
+        }
+
+        // Nothing pending means nothing to move along for, the next place starts from now.
+        if (pending_count == 0) {
+            wheel_tick = now >> TICK_SHIFT;
+            return NULL;
+        }
+
+        wheel_tick++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel_tick & ((1u << (WHEEL_BITS * level)) - 1)) break;
+            cascade(level);
+        }
+    }
 
-    // Free up timer slot again
-    timer->id = 0;
-    timer->end = 0;
-    return 1;
+    return NULL;
 }
 
-void timer_sleep(uint32_t ms) {
-    int timer = timer_new_oneshot(ms);
-    while (!timer_oneshot_is_done(timer));
+void timer_run_expired() {
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+        timer_t *timer = take_expired(get_us());
+        spin_unlock_irqrestore(&timer_lock, flags);
+
+        if (timer == NULL) return;
+        timer->fn(timer);
+    }
 }
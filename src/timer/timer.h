@@ -5,18 +5,35 @@
 
 #define TIMER_PIT 0x00
 
-#define MAX_TIMER_COUNT 32
+// A callback for some time later. Like work_t, it's meant to be part of whatever it's for, so
+// adding one never has to allocate anything and there can be as many as needed.
+typedef struct timer_t {
+    void (*fn)(struct timer_t *timer);  // Must not be NULL
+    uint64_t expires;                   // In us since timer_init
+    uint32_t tick;                      // Where in the wheel it is
+    struct timer_t *prev;
+    struct timer_t *next;
+    struct timer_t **slot;              // NULL unless it's pending
+} timer_t;
 
-// us_between is on a best-effort basis. if it isn't feasible, like for the PIT, it may be slower/faster.
-void timer_init(int timer_type, uint32_t us_between);
+// The timer doesn't tick at a fixed rate, it only interrupts when timer_arm asks it to.
+void timer_init(int timer_type);
 int timer_get_type();
 
-void timer_tick();
+// Time since timer_init, as precise as the timer allows. It's read from the hardware, so it
+// doesn't matter how many interrupts there were in between.
+uint64_t timer_get_us();
+// Sets when the next timer interrupt happens on this CPU, in us since timer_init. It can come
+// earlier than that, e.g. for a pending timer_t, or because the hardware can't wait that long.
+void timer_arm(uint64_t deadline);
 
-// might be shorter or longer, the PIT is very bad!
-int timer_new_oneshot(uint32_t ms);
-int timer_oneshot_is_done(int timer_id);
-// Convenience method that combines the above.`
-void timer_sleep(uint32_t ms);
+// Makes timer->fn run once it's `expires` us since timer_init. It runs in the BSP's timer
+// interrupt, with the kernel lock held and interrupts off, about a ms late at worst. Adding
+// a timer that's still pending moves it. fn can add its own timer again.
+void timer_add(timer_t *timer, uint64_t expires);
+// Takes the timer back, if it hasn't run yet.
+void timer_del(timer_t *timer);
+// Runs every timer that's due. Only the BSP's timer interrupt calls this.
+void timer_run_expired();
 
 #endif
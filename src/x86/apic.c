@@ -0,0 +1,110 @@
+#include "apic.h"
+
+#include <stddef.h>
+
+#include "../mem/virt.h"
+#include "../timer/timer.h"
+
+#define APIC_ID          0x020
+#define APIC_EOI         0x0b0
+#define APIC_SVR         0x0f0
+#define APIC_ICR_LOW     0x300
+#define APIC_ICR_HIGH    0x310
+#define APIC_LVT_TIMER   0x320
+#define APIC_TIMER_INIT  0x380
+#define APIC_TIMER_CURR  0x390
+#define APIC_TIMER_DIV   0x3e0
+
+#define SVR_ENABLE       0x100
+#define LVT_MASKED       0x10000
+#define TIMER_DIV_16     0x3
+
+#define ICR_FIXED        (0 << 8)
+#define ICR_NMI          (4 << 8)
+#define ICR_INIT         (5 << 8)
+#define ICR_STARTUP      (6 << 8)
+#define ICR_PENDING      (1 << 12)
+#define ICR_ASSERT       (1 << 14)
+
+// Long enough for a decent measurement, short enough to fit in one PIT countdown.
+#define CALIBRATE_US     10000
+
+static volatile uint32_t *regs = NULL;
+static uint32_t ticks_per_ms = 0;
+
+static uint32_t read_reg(uint32_t reg) {
+    return regs[reg / sizeof(uint32_t)];
+}
+
+static void write_reg(uint32_t reg, uint32_t value) {
+    regs[reg / sizeof(uint32_t)] = value;
+}
+
+void apic_init(phys_addr_t phys) {
+    regs = virt_map_mmio(phys, PAGE_SIZE);
+}
+
+int apic_is_present() {
+    return regs != NULL;
+}
+
+void apic_enable() {
+    write_reg(APIC_SVR, SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    write_reg(APIC_TIMER_DIV, TIMER_DIV_16);
+    write_reg(APIC_LVT_TIMER, LVT_MASKED | APIC_TIMER_VECTOR);
+}
+
+uint32_t apic_get_id() {
+    return read_reg(APIC_ID) >> 24;
+}
+
+void apic_eoi() {
+    write_reg(APIC_EOI, 0);
+}
+
+static void send(uint32_t apic_id, uint32_t command) {
+    write_reg(APIC_ICR_HIGH, apic_id << 24);
+    write_reg(APIC_ICR_LOW, command);
+    while (read_reg(APIC_ICR_LOW) & ICR_PENDING) {
+        asm volatile ("pause");
+    }
+}
+
+void apic_send_ipi(uint32_t apic_id, uint32_t vector) {
+    send(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+void apic_send_nmi(uint32_t apic_id) {
+    send(apic_id, ICR_NMI | ICR_ASSERT);
+}
+
+void apic_send_init(uint32_t apic_id) {
+    send(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+void apic_send_startup(uint32_t apic_id, uint32_t page) {
+    send(apic_id, ICR_STARTUP | ICR_ASSERT | (page & 0xff));
+}
+
+void apic_calibrate_timer() {
+    write_reg(APIC_TIMER_DIV, TIMER_DIV_16);
+    write_reg(APIC_LVT_TIMER, LVT_MASKED | APIC_TIMER_VECTOR);
+
+    uint64_t start = timer_get_us();
+    write_reg(APIC_TIMER_INIT, 0xffffffff);
+    while (timer_get_us() - start < CALIBRATE_US) {}
+
+    uint32_t elapsed = 0xffffffff - read_reg(APIC_TIMER_CURR);
+    write_reg(APIC_TIMER_INIT, 0);
+    ticks_per_ms = elapsed / (CALIBRATE_US / 1000);
+}
+
+void apic_timer_arm(uint64_t us) {
+    uint64_t ticks = us * ticks_per_ms / 1000;
+    if (ticks == 0) ticks = 1;
+    if (ticks > 0xffffffff) ticks = 0xffffffff;
+
+    // One-shot mode, it stays quiet after this one.
+    write_reg(APIC_LVT_TIMER, APIC_TIMER_VECTOR);
+    write_reg(APIC_TIMER_INIT, ticks);
+}
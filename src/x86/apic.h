@@ -0,0 +1,35 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+#include "../mem/phys.h"
+
+// Interrupts that come from the local APIC instead of the PIC.
+#define APIC_TIMER_VECTOR    0x40
+#define APIC_TLB_VECTOR      0x41
+#define APIC_RESCHED_VECTOR  0x42
+#define APIC_SPURIOUS_VECTOR 0xff
+
+// Every CPU finds its own local APIC at the same physical address, this maps it.
+void apic_init(phys_addr_t phys);
+int apic_is_present();
+// Turns on the local APIC of the CPU this runs on. Its timer stays off until it's armed.
+void apic_enable();
+uint32_t apic_get_id();
+void apic_eoi();
+
+void apic_send_ipi(uint32_t apic_id, uint32_t vector);
+// NMIs get through even with interrupts off, e.g. to a CPU spinning on a lock.
+void apic_send_nmi(uint32_t apic_id);
+void apic_send_init(uint32_t apic_id);
+// Makes the CPU start in real mode at page * 4KiB.
+void apic_send_startup(uint32_t apic_id, uint32_t page);
+
+// Measures how fast the APIC timers run against the PIT. They all run at the same speed,
+// so once on any CPU is enough.
+void apic_calibrate_timer();
+// One APIC_TIMER_VECTOR interrupt on this CPU, after `us` microseconds.
+void apic_timer_arm(uint64_t us);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Feature bits in EDX of CPUID leaf 1.
+#define CPUID_EDX_PSE   (1 << 3)
+#define CPUID_EDX_PAE   (1 << 6)
+#define CPUID_EDX_PGE   (1 << 13)
+#define CPUID_EDX_FXSR  (1 << 24)
+#define CPUID_EDX_SSE   (1 << 25)
+
+#define CR0_MP          (1 << 1)
+#define CR0_EM          (1 << 2)
+#define CR0_TS          (1 << 3)
+#define CR0_NE          (1 << 5)
+
+#define CR4_PSE         (1 << 4)
+#define CR4_PAE         (1 << 5)
+#define CR4_PGE         (1 << 7)
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile ("cpuid"
+                  : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                  : "a" (leaf), "c" (0));
+}
+
+static inline int cpu_has_feature_edx(uint32_t bit) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & bit) != 0;
+}
+
+static inline uint32_t cpu_get_cr0() {
+    uint32_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void cpu_set_cr0(uint32_t cr0) {
+    asm volatile ("mov %0, %%cr0" :: "r" (cr0) : "memory");
+}
+
+static inline uint32_t cpu_get_cr4() {
+    uint32_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+static inline void cpu_set_cr4(uint32_t cr4) {
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+static inline uint64_t cpu_rdtsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#include "fpu.h"
+
+#include "../io/vga.h"
+#include "../misc.h"
+#include "cpu.h"
+
+// What a process starts out with: fninit, and all SSE exceptions masked.
+static uint8_t initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+static int is_present = 0;
+
+void fpu_init() {
+    // The BSP comes first, the APs are the same kind of CPU.
+    static int checked = 0;
+    if (!checked) {
+        checked = 1;
+        is_present = cpu_has_feature_edx(CPUID_EDX_FXSR) && cpu_has_feature_edx(CPUID_EDX_SSE);
+        if (!is_present) vga_printf("fpu.c: No FXSAVE or SSE, processes can't use the FPU\n");
+    }
+
+    if (!is_present) return;
+
+    // MP makes wait/fwait trap on TS too, NE reports x87 errors as #MF instead of through the PIC.
+    cpu_set_cr0((cpu_get_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    cpu_set_cr4(cpu_get_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+    uint32_t mxcsr = 0x1f80;
+    fpu_enable();
+    asm volatile ("fninit");
+    asm volatile ("ldmxcsr %0" :: "m" (mxcsr));
+    // Every CPU ends up with the same thing, it doesn't matter who writes it last.
+    fpu_save(initial_state);
+    fpu_disable();
+}
+
+int fpu_is_present() {
+    return is_present;
+}
+
+void fpu_init_state(void *state) {
+    memcpy(state, initial_state, FPU_STATE_SIZE);
+}
+
+void fpu_save(void *state) {
+    asm volatile ("fxsave (%0)" :: "r" (state) : "memory");
+}
+
+void fpu_restore(void *state) {
+    asm volatile ("fxrstor (%0)" :: "r" (state) : "memory");
+}
+
+void fpu_enable() {
+    asm volatile ("clts");
+}
+
+void fpu_disable() {
+    cpu_set_cr0(cpu_get_cr0() | CR0_TS);
+}
+
+int fpu_is_enabled() {
+    return (cpu_get_cr0() & CR0_TS) == 0;
+}
@@ -0,0 +1,26 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+// What FXSAVE writes, x87 and SSE registers. It has to be 16 byte aligned.
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+
+// Turns on the FPU and SSE on the CPU this runs on, with CR0.TS set, so the first use
+// traps. Every CPU has to call this.
+void fpu_init();
+// Without FXSAVE, processes don't get to use the FPU at all.
+int fpu_is_present();
+
+// Fills state with what a freshly initialized FPU looks like.
+void fpu_init_state(void *state);
+void fpu_save(void *state);
+void fpu_restore(void *state);
+
+// Until fpu_disable, the FPU can be used without a #NM.
+void fpu_enable();
+void fpu_disable();
+int fpu_is_enabled();
+
+#endif
@@ -19,8 +19,9 @@ set_gdtr:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     mov ss, ax
+    mov ax, 0x30                ; per-CPU data, see gdt.c
+    mov gs, ax
     ret
 
 global set_tr
@@ -3,8 +3,9 @@
 #include <stdint.h>
 
 #include "../io/vga.h"
+#include "smp.h"
 
-#define GDT_SIZE 6
+#define GDT_SIZE 7
 
 #define ACC_PRESENT     0x80
 #define ACC_DPL_0       0x00
@@ -30,13 +31,15 @@ typedef struct __attribute__((packed)) gdt_entry {
     uint8_t base2;
 } gdt_entry;
 
-static gdt_entry gdt[GDT_SIZE];
-static uint32_t tss[32] = { 0 };
+// Every CPU gets its own GDT, so the TSS and the per-CPU data (the last entry, %gs) have
+// the same selectors everywhere.
+static gdt_entry gdts[MAX_CPUS][GDT_SIZE];
+static uint32_t tsss[MAX_CPUS][32];
 
 extern void set_gdtr(gdt_entry *gdt, uint16_t size);
 extern void set_tr(uint32_t *tss, uint16_t selector);
 
-void set_entry(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+void set_entry(gdt_entry *gdt, int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
     gdt_entry *entry = &gdt[i];
 
     entry->base = base & 0xffffff;
@@ -49,25 +52,32 @@ void set_entry(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t fla
     entry->flags = flags & 0xf;
 }
 
-void gdt_load() {
-    set_entry(0, 0, 0, 0, 0);
+void gdt_load(uint32_t cpu) {
+    gdt_entry *gdt = gdts[cpu];
+    uint32_t *tss = tsss[cpu];
 
-    set_entry(1, 0, 0xfffff, ACC_PRESENT | ACC_DPL_0 | ACC_CODE_SEG | ACC_READABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
-    set_entry(2, 0, 0xfffff, ACC_PRESENT | ACC_DPL_0 | ACC_DATA_SEG | ACC_WRITABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
-    set_entry(3, 0, 0xfffff, ACC_PRESENT | ACC_DPL_3 | ACC_CODE_SEG | ACC_READABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
-    set_entry(4, 0, 0xfffff, ACC_PRESENT | ACC_DPL_3 | ACC_DATA_SEG | ACC_WRITABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
+    set_entry(gdt, 0, 0, 0, 0, 0);
 
-    set_entry(5, (uint32_t) tss, sizeof(tss), ACC_PRESENT | ACC_DPL_0 | ACC_TSS_32BIT, 0);
+    set_entry(gdt, 1, 0, 0xfffff, ACC_PRESENT | ACC_DPL_0 | ACC_CODE_SEG | ACC_READABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
+    set_entry(gdt, 2, 0, 0xfffff, ACC_PRESENT | ACC_DPL_0 | ACC_DATA_SEG | ACC_WRITABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
+    set_entry(gdt, 3, 0, 0xfffff, ACC_PRESENT | ACC_DPL_3 | ACC_CODE_SEG | ACC_READABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
+    set_entry(gdt, 4, 0, 0xfffff, ACC_PRESENT | ACC_DPL_3 | ACC_DATA_SEG | ACC_WRITABLE, FLG_PAGE_GRAN | FLG_SIZE_32BIT);
+
+    set_entry(gdt, 5, (uint32_t) tss, sizeof(tsss[cpu]), ACC_PRESENT | ACC_DPL_0 | ACC_TSS_32BIT, 0);
+
+    cpu_t *percpu = smp_get_cpu(cpu);
+    set_entry(gdt, 6, (uint32_t) percpu, sizeof(cpu_t) - 1, ACC_PRESENT | ACC_DPL_0 | ACC_DATA_SEG | ACC_WRITABLE, FLG_SIZE_32BIT);
 
     set_gdtr(gdt, sizeof(gdt_entry) * GDT_SIZE - 1);
     set_tr(tss, 0x28);
 }
 
 void gdt_set_kernel_stack(void *stack) {
-    tss[1] = (uint32_t) stack;
+    tsss[smp_cpu_id()][1] = (uint32_t) stack;
 }
 
 void gdt_print() {
+    gdt_entry *gdt = gdts[smp_cpu_id()];
     for (int i = 0; i < GDT_SIZE; i++) {
         gdt_entry entry = gdt[i];
         vga_printf("%d: %2x%6x %x%4x %2x %x\n", i, entry.base2, entry.base, entry.limit2, entry.limit, entry.access, entry.flags);
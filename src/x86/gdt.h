@@ -1,7 +1,9 @@
 #ifndef GDT_H
 #define GDT_H
 
-void gdt_load();
+#include <stdint.h>
+
+void gdt_load(uint32_t cpu);
 void gdt_set_kernel_stack(void *stack);
 void gdt_print();
 
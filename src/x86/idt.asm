@@ -136,6 +136,7 @@ isrs:
 %endrep
 
 extern handle_interrupt
+extern smp_unlock_kernel_if_held
 
 common_isr:
     pushad
@@ -144,11 +145,17 @@ common_isr:
     mov ax, 0x10
     mov ds, ax
     mov es, ax
+    mov ax, 0x30                ; per-CPU data, user mode doesn't get to keep it
+    mov gs, ax
 
     cld
     call handle_interrupt
     mov esp, eax
 
+    ; Another CPU could pick up the process we came from as soon as the kernel lock is
+    ; free, so that has to wait until we're off its kernel stack.
+    call smp_unlock_kernel_if_held
+
     mov ax, 0x23
     mov ds, ax
     mov es, ax
@@ -169,6 +176,12 @@ setup_idt:
     lidt [idtr]
     ret
 
+; For APs, the IDT itself is already set up.
+global reload_idt
+reload_idt:
+    lidt [idtr]
+    ret
+
 global enable_interrupts
 enable_interrupts:
     sti
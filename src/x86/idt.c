@@ -5,8 +5,11 @@
 #include "../proc/proc.h"
 #include "../timer/devices/pit.h"
 #include "../timer/timer.h"
+#include "../mem/virt.h"
 #include "../x86/gdt.h"
 #include "../syscall/syscall.h"
+#include "apic.h"
+#include "smp.h"
 
 #define PIC1_CMD  0x20
 #define PIC1_DATA 0x21
@@ -61,7 +64,7 @@ static int_ctx_t *handle_irq(int_ctx_t *ctx) {
     outb(PIC1_CMD, PIC_EOI);
 
     if (timer_get_type() == TIMER_PIT && irq == 0) {
-        timer_tick();
+        timer_run_expired();
         ctx = proc_schedule(ctx);
     } else {
         vga_printf("IRQ %d\n", irq);
@@ -71,6 +74,7 @@ static int_ctx_t *handle_irq(int_ctx_t *ctx) {
 }
 
 extern void setup_idt(); // idt.asm
+extern void reload_idt(); // idt.asm
 
 void idt_load() {
     setup_idt();
@@ -88,7 +92,19 @@ void idt_load() {
     outb(PIC2_DATA, 0);                     // same same
 }
 
-int_ctx_t *handle_interrupt(int_ctx_t *ctx) {
+void idt_load_ap() {
+    reload_idt();
+}
+
+static int_ctx_t *dispatch(int_ctx_t *ctx) {
+    if (ctx->int_nr == 0x0e) {
+        void *addr;
+        asm ("mov %%cr2, %0" : "=r" (addr));
+        if (virt_handle_page_fault(addr, ctx->err)) return ctx;
+    } else if (ctx->int_nr == 0x07) {
+        if (proc_handle_fpu_trap()) return ctx;
+    }
+
     if (ctx->int_nr < 0x20) {
         // Could use panic here, but that's a *lot* of varargs.
         vga_set_color(0x0c);
@@ -103,11 +119,27 @@ int_ctx_t *handle_interrupt(int_ctx_t *ctx) {
             vga_printf("cr2 %8x\n", addr);
         }
 
+        // A process can only take itself down. Nothing else is any the wiser, so it goes
+        // away like it had called exit.
+        if ((ctx->cs & 3) == 3) {
+            vga_printf("Killing process %u\n", proc_get_id(proc_get_current_proc()));
+            vga_set_color(0xf0);
+            proc_exit_current();
+            return proc_schedule(ctx);
+        }
+
+        // We hold the kernel lock, so the other CPUs would be stuck waiting for it anyway.
+        smp_halt_others();
         while (1);
     }
 
     if (ctx->int_nr < 0x30) {
         return handle_irq(ctx);
+    } else if (ctx->int_nr == APIC_TIMER_VECTOR || ctx->int_nr == APIC_RESCHED_VECTOR) {
+        apic_eoi();
+        return proc_schedule(ctx);
+    } else if (ctx->int_nr == PROC_YIELD_VECTOR) {
+        return proc_handle_yield(ctx);
     } else if (ctx->int_nr == 0x69) {
         return syscall_handle(ctx);
     } else {
@@ -116,3 +148,22 @@ int_ctx_t *handle_interrupt(int_ctx_t *ctx) {
 
     return ctx;
 }
+
+int_ctx_t *handle_interrupt(int_ctx_t *ctx) {
+    // Whoever asks for a shootdown holds the kernel lock while waiting for us.
+    if (ctx->int_nr == APIC_TLB_VECTOR) {
+        smp_handle_tlb_flush();
+        apic_eoi();
+        return ctx;
+    } else if (ctx->int_nr == APIC_SPURIOUS_VECTOR) {
+        return ctx;
+    } else if (ctx->int_nr == 0x02 && smp_is_halted()) {
+        // Another CPU hit a fatal error, see smp_halt_others. NMIs stay blocked until an
+        // iret, which never comes.
+        while (1) asm volatile ("cli; hlt");
+    }
+
+    // common_isr gives it back.
+    smp_lock_kernel();
+    return dispatch(ctx);
+}
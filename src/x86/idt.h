@@ -24,6 +24,8 @@ typedef struct __attribute__((packed)) int_ctx_t {
 } int_ctx_t;
 
 void idt_load();
+// Makes an AP use the IDT idt_load set up.
+void idt_load_ap();
 int_ctx_t *handle_interrupt(int_ctx_t *ctx);
 
 #endif
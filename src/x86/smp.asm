@@ -0,0 +1,73 @@
+; APs start out in real mode, at the start of a page below 1MiB. smp.c copies everything
+; between smp_trampoline_start and smp_trampoline_end there and fills in the data part.
+; It only knows where it ended up through cs, so everything is relative to that.
+
+; where smp_trampoline_data is, from the start of the trampoline
+DATA equ smp_trampoline_data - smp_trampoline_start
+
+section .text
+bits 16
+global smp_trampoline_start
+smp_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4                  ; physical address of the trampoline
+
+    lgdt [DATA]
+    mov eax, cr0
+    or eax, 1                   ; PE = 1
+    mov cr0, eax
+    o32 jmp far [DATA + 6]
+
+bits 32
+global smp_trampoline_protected
+smp_trampoline_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; same paging setup as the BSP. the trampoline is identity mapped, so we can keep going
+    mov eax, dword [ebx + DATA + 20]        ; cr4
+    mov cr4, eax
+    mov eax, dword [ebx + DATA + 16]        ; cr3
+    mov cr3, eax
+    mov eax, dword [ebx + DATA + 12]        ; cr0
+    mov cr0, eax
+
+    mov esp, dword [ebx + DATA + 24]
+    mov eax, dword [ebx + DATA + 28]
+    call eax                    ; never comes back
+.hang:
+    hlt
+    jmp .hang
+
+; flat code and data, just like the real GDT has them
+align 8
+global smp_trampoline_gdt
+smp_trampoline_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff
+    dq 0x00cf92000000ffff
+
+; has to match trampoline_data_t in smp.c
+global smp_trampoline_data
+smp_trampoline_data:
+    dw 0                        ; gdt limit
+    dd 0                        ; gdt base
+    dd 0                        ; smp_trampoline_protected
+    dw 0x08                     ; and its code segment
+    dd 0                        ; cr0
+    dd 0                        ; cr3
+    dd 0                        ; cr4
+    dd 0                        ; stack
+    dd 0                        ; entry
+
+global smp_trampoline_end
+smp_trampoline_end:
@@ -0,0 +1,340 @@
+#include "smp.h"
+
+#include "../io/vga.h"
+#include "../mem/phys.h"
+#include "../mem/virt.h"
+#include "../misc.h"
+#include "../proc/proc.h"
+#include "../timer/timer.h"
+#include "apic.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "spinlock.h"
+
+#define AP_STACK_SIZE 16384
+// How long an AP gets to show up after its startup IPIs, in us.
+#define AP_BOOT_TIMEOUT 100000
+
+#define MP_FLOAT_SIGNATURE  0x5f504d5f // "_MP_"
+#define MP_CONFIG_SIGNATURE 0x504d4350 // "PCMP"
+#define MP_ENTRY_PROC       0
+#define MP_PROC_ENABLED     0x01
+#define MP_PROC_BSP         0x02
+// Every other kind of entry in the MP configuration table has this size.
+#define MP_ENTRY_SIZE       8
+
+// The MP floating pointer structure, which the BIOS leaves somewhere in low memory.
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t config;
+    uint8_t length;         // In 16 byte units
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} mp_float_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} mp_config_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} mp_proc_t;
+
+// Has to match smp_trampoline_data in smp.asm.
+typedef struct __attribute__((packed)) {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint32_t protected_entry;
+    uint16_t code_selector;
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+} trampoline_data_t;
+
+// smp.asm
+extern char smp_trampoline_start[];
+extern char smp_trampoline_protected[];
+extern char smp_trampoline_gdt[];
+extern char smp_trampoline_data[];
+extern char smp_trampoline_end[];
+
+extern void enable_interrupts(); // idt.asm
+
+static cpu_t cpus[MAX_CPUS];
+static uint32_t cpu_count = 1;
+static volatile uint32_t online_mask = 1;
+static volatile int released = 0;
+// The AP that's being started right now. They only come up one at a time.
+static volatile uint32_t booting = 0;
+// Set once some CPU gave up for good, NMIs mean stop then. See smp_halt_others.
+static volatile int halted = 0;
+
+static recursive_spinlock_t kernel_lock = RECURSIVE_SPINLOCK_INIT("kernel");
+
+cpu_t *smp_get_cpu(uint32_t id) {
+    return &cpus[id];
+}
+
+uint32_t smp_cpu_count() {
+    return cpu_count;
+}
+
+uint32_t smp_online_mask() {
+    return online_mask;
+}
+
+static int checksum_ok(void *start, uint32_t size) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        sum += ((uint8_t *) start)[i];
+    }
+
+    return sum == 0;
+}
+
+static mp_float_t *scan_for_float(uint32_t phys, uint32_t size) {
+    for (uint32_t addr = phys; addr + sizeof(mp_float_t) <= phys + size; addr += 16) {
+        mp_float_t *mp = (mp_float_t *) (DIRECT_MAP_START + addr);
+        if (mp->signature == MP_FLOAT_SIGNATURE && checksum_ok(mp, mp->length * 16)) return mp;
+    }
+
+    return NULL;
+}
+
+// The floating pointer is in the first KiB of the EBDA, the last KiB of base memory, or
+// somewhere in the BIOS ROM.
+static mp_config_t *find_config() {
+    uint32_t ebda = *(uint16_t *) (DIRECT_MAP_START + 0x40e) << 4;
+    uint32_t base_end = *(uint16_t *) (DIRECT_MAP_START + 0x413) * 1024;
+
+    mp_float_t *mp = NULL;
+    if (ebda != 0) mp = scan_for_float(ebda, 1024);
+    if (mp == NULL && base_end >= 1024) mp = scan_for_float(base_end - 1024, 1024);
+    if (mp == NULL) mp = scan_for_float(0xf0000, 0x10000);
+
+    // No table means default configurations we don't bother with, so one CPU it is.
+    if (mp == NULL || mp->config == 0) return NULL;
+
+    // It's always in low memory in practice, which is in the direct map.
+    if (mp->config + sizeof(mp_config_t) > phys_get_mem_end() || mp->config >= DIRECT_MAP_MAX) return NULL;
+
+    mp_config_t *config = (mp_config_t *) (DIRECT_MAP_START + mp->config);
+    if (config->signature != MP_CONFIG_SIGNATURE || !checksum_ok(config, config->length)) return NULL;
+    return config;
+}
+
+// The PIT only counts for so long without being rearmed, so keep doing that.
+static void wait_us(uint64_t us) {
+    uint64_t end = timer_get_us() + us;
+    while (timer_get_us() < end) {
+        timer_arm(end);
+    }
+}
+
+static void ap_main() {
+    uint32_t id = booting;
+
+    gdt_load(id);
+    idt_load_ap();
+    fpu_init();
+    apic_enable();
+    virt_init_ap();
+
+    __sync_fetch_and_or(&online_mask, 1u << id);
+
+    // The BSP might still change kernel mappings until then, and we're part of its shootdowns.
+    while (!released) {
+        smp_handle_tlb_flush();
+        asm volatile ("pause");
+    }
+
+    // Whatever got shot down before we were online might still be cached.
+    virt_flush_tlb(1);
+
+    // Have a look at the run queue right away, processes might be waiting there already.
+    apic_timer_arm(1000);
+    enable_interrupts();
+    proc_idle();
+}
+
+static int start_ap(uint32_t id, uint32_t low_page, trampoline_data_t *data) {
+    cpu_t *cpu = &cpus[id];
+    cpu->id = id;
+    cpu->stack = vmalloc(AP_STACK_SIZE);
+    if (cpu->stack == NULL) return 0;
+
+    data->stack = (uint32_t) cpu->stack + AP_STACK_SIZE;
+    booting = id;
+
+    // INIT, then two startup IPIs, like Intel's MP spec says.
+    apic_send_init(cpu->apic_id);
+    wait_us(10000);
+    apic_send_startup(cpu->apic_id, low_page / PAGE_SIZE);
+    wait_us(200);
+    if (!(online_mask & (1u << id))) apic_send_startup(cpu->apic_id, low_page / PAGE_SIZE);
+
+    uint64_t end = timer_get_us() + AP_BOOT_TIMEOUT;
+    while (!(online_mask & (1u << id)) && timer_get_us() < end) {
+        timer_arm(end);
+    }
+
+    if (online_mask & (1u << id)) return 1;
+
+    vfree(cpu->stack, AP_STACK_SIZE);
+    cpu->stack = NULL;
+    return 0;
+}
+
+void smp_init() {
+    mp_config_t *config = find_config();
+    if (config == NULL) {
+        vga_printf("smp.c: No MP table, only using one CPU\n");
+        return;
+    }
+
+    apic_init(config->lapic);
+    if (!apic_is_present()) {
+        vga_printf("smp.c: Couldn't map the local APIC, only using one CPU\n");
+        return;
+    }
+
+    apic_calibrate_timer();
+    apic_enable();
+    cpus[0].apic_id = apic_get_id();
+
+    uint32_t low_page = phys_get_low_page();
+    if (low_page == 0) {
+        vga_printf("smp.c: No memory below 1MiB for the APs to start in, only using one CPU\n");
+        return;
+    }
+
+    // Set up the trampoline once, only the stack is different for each AP.
+    uint32_t trampoline_size = smp_trampoline_end - smp_trampoline_start;
+    void *trampoline = (void *) (DIRECT_MAP_START + low_page);
+    memcpy(trampoline, smp_trampoline_start, trampoline_size);
+
+    trampoline_data_t *data = trampoline + (smp_trampoline_data - smp_trampoline_start);
+    data->gdt_limit = 3 * 8 - 1;
+    data->gdt_base = low_page + (smp_trampoline_gdt - smp_trampoline_start);
+    data->protected_entry = low_page + (smp_trampoline_protected - smp_trampoline_start);
+    data->code_selector = 0x08;
+    data->cr0 = cpu_get_cr0();
+    data->cr3 = virt_get_kernel_cr3();
+    data->cr4 = cpu_get_cr4();
+    data->entry = (uint32_t) ap_main;
+
+    // Paging gets turned on while the AP still runs the trampoline.
+    virt_unsafe_identity_map((void *) low_page);
+
+    uint8_t *entry = (uint8_t *) (config + 1);
+    for (uint32_t i = 0; i < config->entry_count && cpu_count < MAX_CPUS; i++) {
+        if (*entry != MP_ENTRY_PROC) {
+            entry += MP_ENTRY_SIZE;
+            continue;
+        }
+
+        mp_proc_t *proc = (mp_proc_t *) entry;
+        entry += sizeof(mp_proc_t);
+        if (!(proc->flags & MP_PROC_ENABLED) || (proc->flags & MP_PROC_BSP)) continue;
+
+        // An AP that didn't make it might still come up later, and it would take whatever is
+        // in the trampoline with it. Better not start any more after that.
+        cpus[cpu_count].apic_id = proc->apic_id;
+        if (!start_ap(cpu_count, low_page, data)) {
+            vga_printf("smp.c: CPU with APIC ID %u didn't start\n", proc->apic_id);
+            break;
+        }
+
+        cpu_count++;
+    }
+
+    virt_unsafe_identity_unmap((void *) low_page);
+    vga_printf("smp.c: %u CPUs online\n", cpu_count);
+}
+
+void smp_release() {
+    released = 1;
+}
+
+void smp_lock_kernel() {
+    // Interrupts are off in here, and whoever has the lock might be waiting for us to flush
+    // our TLB.
+    spin_lock_recursive(&kernel_lock, smp_handle_tlb_flush);
+}
+
+void smp_unlock_kernel() {
+    spin_unlock_recursive(&kernel_lock);
+}
+
+void smp_unlock_kernel_if_held() {
+    if (spin_is_held_recursive(&kernel_lock)) smp_unlock_kernel();
+}
+
+void smp_flush_tlbs(uint32_t mask, uint32_t what) {
+    mask &= online_mask;
+
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        if (!(mask & (1u << id))) continue;
+        __sync_fetch_and_or(&cpus[id].tlb_flush, what);
+        apic_send_ipi(cpus[id].apic_id, APIC_TLB_VECTOR);
+    }
+
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        if (!(mask & (1u << id))) continue;
+        while (cpus[id].tlb_flush != 0) {
+            asm volatile ("pause");
+        }
+    }
+}
+
+void smp_handle_tlb_flush() {
+    cpu_t *cpu = &cpus[smp_cpu_id()];
+    uint32_t what = cpu->tlb_flush;
+    if (what == 0) return;
+
+    // The requester is still waiting, so this has to happen before it hears back.
+    if (what & SMP_FLUSH_ABANDONED) virt_leave_abandoned();
+    virt_flush_tlb(what & SMP_FLUSH_GLOBAL);
+    __sync_fetch_and_and(&cpu->tlb_flush, ~what);
+}
+
+void smp_halt_others() {
+    halted = 1;
+    if (!apic_is_present()) return;
+
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        if (id != smp_cpu_id() && (online_mask & (1u << id))) apic_send_nmi(cpus[id].apic_id);
+    }
+}
+
+int smp_is_halted() {
+    return halted;
+}
+
+void smp_send_resched(uint32_t id) {
+    if (!apic_is_present() || !(online_mask & (1u << id))) return;
+    apic_send_ipi(cpus[id].apic_id, APIC_RESCHED_VECTOR);
+}
@@ -0,0 +1,57 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+#define MAX_CPUS 8
+
+// What every CPU knows about itself. %gs points at its own one, see gdt.c.
+typedef struct cpu_t {
+    uint32_t id;                    // Index into the CPU table, has to come first for smp_cpu_id
+    uint32_t apic_id;
+    volatile uint32_t tlb_flush;    // SMP_FLUSH_* requests that haven't been handled yet
+    void *stack;                    // Boot and idle stack for APs
+} cpu_t;
+
+// What smp_flush_tlbs asks other CPUs to throw out.
+#define SMP_FLUSH_USER   0x01
+#define SMP_FLUSH_GLOBAL 0x02
+// Switch away from the context virt_abandon_ctx is getting rid of, if it's still loaded.
+#define SMP_FLUSH_ABANDONED 0x04
+
+static inline uint32_t smp_cpu_id() {
+    uint32_t id;
+    asm ("mov %%gs:0, %0" : "=r" (id));
+    return id;
+}
+
+cpu_t *smp_get_cpu(uint32_t id);
+uint32_t smp_cpu_count();
+// Bit n is set if CPU n is up. Every one of them takes part in TLB shootdowns.
+uint32_t smp_online_mask();
+
+// Finds the other CPUs and starts them. They wait with interrupts off until smp_release.
+void smp_init();
+// Lets the other CPUs go into proc_idle, i.e., start running processes.
+void smp_release();
+
+// One lock for the whole kernel. handle_interrupt takes it, and common_isr gives it back
+// once it's off the old kernel stack. The same CPU can take it more than once.
+void smp_lock_kernel();
+void smp_unlock_kernel();
+// Gives the lock back if this CPU holds it, for the way out of an interrupt.
+void smp_unlock_kernel_if_held();
+
+// Makes the CPUs in mask flush their TLBs (global pages too with SMP_FLUSH_GLOBAL), and
+// waits until they did. Needs the kernel lock.
+void smp_flush_tlbs(uint32_t mask, uint32_t what);
+// Does whatever smp_flush_tlbs asked this CPU to do.
+void smp_handle_tlb_flush();
+// Stops every other CPU for good, with an NMI, before this one hangs on a fatal error.
+void smp_halt_others();
+// Whether smp_halt_others was called, i.e. an NMI means this CPU should stop.
+int smp_is_halted();
+// Makes another CPU run the scheduler soon, e.g. because it's idle and there's work now.
+void smp_send_resched(uint32_t id);
+
+#endif
@@ -0,0 +1,103 @@
+#include "spinlock.h"
+
+#include "../io/vga.h"
+#include "../misc.h"
+#include "cpu.h"
+#include "smp.h"
+
+#define EFLAGS_IF 0x200
+
+static spinlock_t *locks = NULL;
+
+// Only the lock holder gets here, so the flag itself is safe. The list isn't, other CPUs
+// could be adding their own locks at the same time.
+static void list_lock(spinlock_t *lock) {
+    lock->is_listed = 1;
+    do {
+        lock->next = locks;
+    } while (!__sync_bool_compare_and_swap(&locks, lock->next, lock));
+}
+
+void spin_lock_polling(spinlock_t *lock, void (*poll)()) {
+    // lock xadd, so every ticket goes to exactly one CPU.
+    uint32_t ticket = __sync_fetch_and_add(&lock->next_ticket, 1);
+
+    if (lock->now_serving != ticket) {
+        uint64_t start = cpu_rdtsc();
+        while (lock->now_serving != ticket) {
+            if (poll != NULL) poll();
+            asm volatile ("pause" ::: "memory");
+        }
+
+        // We hold it now, so the counters are ours to change.
+        lock->contended++;
+        lock->spin_cycles += cpu_rdtsc() - start;
+    }
+
+    lock->acquisitions++;
+    if (!lock->is_listed) list_lock(lock);
+}
+
+void spin_lock(spinlock_t *lock) {
+    spin_lock_polling(lock, NULL);
+}
+
+void spin_unlock(spinlock_t *lock) {
+    // Only the holder writes now_serving, but everything it did has to be visible first.
+    __atomic_store_n(&lock->now_serving, lock->now_serving + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r" (flags) :: "memory");
+
+    // The TLB flush IPI can't get through now, and the holder might be waiting on it, e.g.
+    // from vmalloc under the proc lock.
+    spin_lock_polling(lock, smp_handle_tlb_flush);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    if (flags & EFLAGS_IF) asm volatile ("sti" ::: "memory");
+}
+
+void spin_lock_recursive(recursive_spinlock_t *lock, void (*poll)()) {
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r" (flags) :: "memory");
+
+    // Only we ever write our own ID, so nobody else can make this true.
+    uint32_t me = smp_cpu_id() + 1;
+    if (lock->owner == me) {
+        lock->depth++;
+        return;
+    }
+
+    spin_lock_polling(&lock->lock, poll);
+    lock->owner = me;
+    lock->depth = 1;
+    lock->flags = flags;
+}
+
+void spin_unlock_recursive(recursive_spinlock_t *lock) {
+    if (--lock->depth != 0) return;
+
+    uint32_t flags = lock->flags;
+    lock->owner = 0;
+    spin_unlock_irqrestore(&lock->lock, flags);
+}
+
+int spin_is_held_recursive(recursive_spinlock_t *lock) {
+    return lock->owner == smp_cpu_id() + 1;
+}
+
+void spinlock_print_stats() {
+    vga_printf("spinlocks (name: acquisitions, waited n times for n kcycles):\n");
+    for (spinlock_t *lock = locks; lock != NULL; lock = lock->next) {
+        vga_printf("  %s: %u, waited %u times for %u kcycles\n",
+                   lock->name,
+                   lock->acquisitions,
+                   lock->contended,
+                   (uint32_t) (lock->spin_cycles / 1000));
+    }
+}
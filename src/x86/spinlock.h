@@ -0,0 +1,50 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+// A ticket lock: everyone takes a number and waits for it to come up, so CPUs get the lock in
+// the order they asked for it. Not recursive. Each lock counts how it's used, so hot ones are
+// easy to find, see spinlock_print_stats.
+typedef struct spinlock_t {
+    volatile uint32_t next_ticket;
+    volatile uint32_t now_serving;
+
+    const char *name;
+    uint32_t acquisitions;
+    uint32_t contended;         // Acquisitions that had to wait
+    uint64_t spin_cycles;       // TSC cycles spent waiting, in total
+    int is_listed;
+    struct spinlock_t *next;    // All locks that were ever taken, for the stats
+} spinlock_t;
+
+#define SPINLOCK_INIT(lock_name) { .name = (lock_name) }
+
+void spin_lock(spinlock_t *lock);
+// Same, but calls poll every time around while waiting.
+void spin_lock_polling(spinlock_t *lock, void (*poll)());
+void spin_unlock(spinlock_t *lock);
+// For locks that interrupt handlers take too. Returns what spin_unlock_irqrestore needs.
+uint32_t spin_lock_irqsave(spinlock_t *lock);
+// Interrupts are only turned back on if they were on before spin_lock_irqsave.
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags);
+
+// A spinlock the CPU holding it can take again, only the outermost unlock gives it back.
+// Interrupts stay off for as long as it's held.
+typedef struct {
+    spinlock_t lock;
+    volatile uint32_t owner;    // The holder's CPU ID + 1, 0 if it's free
+    uint32_t depth;
+    uint32_t flags;             // From before the outermost lock
+} recursive_spinlock_t;
+
+#define RECURSIVE_SPINLOCK_INIT(lock_name) { .lock = SPINLOCK_INIT(lock_name) }
+
+// Calls poll while waiting, like spin_lock_polling.
+void spin_lock_recursive(recursive_spinlock_t *lock, void (*poll)());
+void spin_unlock_recursive(recursive_spinlock_t *lock);
+int spin_is_held_recursive(recursive_spinlock_t *lock);
+
+void spinlock_print_stats();
+
+#endif
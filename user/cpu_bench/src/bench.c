@@ -0,0 +1,64 @@
+#include <stdint.h>
+
+// Every worker does the same amount of work, so with enough CPUs, they should all be done
+// about as quickly as one of them alone. With one CPU, the last one takes WORKERS times as long.
+#define WORKERS 4
+#define ROUNDS 200000000
+
+extern void exit();
+extern void putc(uint32_t c);
+// Returns the child's ID in the parent, 0 in the child, and -1 on failure.
+extern uint32_t fork();
+
+static void puts(const char *str) {
+    while (*str) putc(0x0f00 | *str++);
+}
+
+static void put_hex(uint64_t value) {
+    puts("0x");
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        putc(0x0f00 | "0123456789abcdef"[(value >> shift) & 0xf]);
+    }
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+// Only touches registers, so the workers don't slow each other down through memory.
+static uint32_t work() {
+    uint32_t x = 1;
+    for (uint32_t i = 0; i < ROUNDS; i++) {
+        x = x * 1664525 + 1013904223;
+        asm volatile ("" : "+r" (x));
+    }
+
+    return x;
+}
+
+void _start() {
+    uint64_t start = rdtsc();
+
+    // The children get a copy of start, so everyone measures from the same point.
+    uint32_t worker = 0;
+    for (uint32_t i = 1; i < WORKERS; i++) {
+        if (fork() == 0) {
+            worker = i;
+            break;
+        }
+    }
+
+    work();
+    uint64_t cycles = rdtsc() - start;
+
+    putc(0x0f00 | ('0' + worker));
+    puts(": ");
+    put_hex(cycles);
+    puts(" cycles\n");
+
+    exit();
+
+    while (1);
+}
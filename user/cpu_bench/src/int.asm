@@ -0,0 +1,32 @@
+section .text
+global putc
+putc:
+    push ebp
+    mov ebp, esp
+    push ebx
+
+    mov ebx, dword [ebp + 8]
+    mov eax, 1
+    int 0x69
+
+    pop ebx
+    leave
+    ret
+
+global fork
+fork:
+    mov eax, 2
+    int 0x69
+    ret
+
+global exit
+exit:
+    xor eax, eax
+    int 0x69
+
+.scream:
+    mov ebx, 0xc000 | 'A'
+    inc eax
+    int 0x60
+
+    jmp .scream
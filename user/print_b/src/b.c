@@ -2,10 +2,12 @@
 
 extern void exit();
 extern void putc(uint32_t c);
+extern void sleep(uint32_t ms);
 
 void _start() {
     for (int i = 0; i < 4; i++) {
         putc(0x0f00 | 'b');
+        sleep(100);
     }
 
     exit();
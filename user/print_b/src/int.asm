@@ -13,6 +13,20 @@ putc:
     leave
     ret
 
+global sleep
+sleep:
+    push ebp
+    mov ebp, esp
+    push ebx
+
+    mov ebx, dword [ebp + 8]
+    mov eax, 8
+    int 0x69
+
+    pop ebx
+    leave
+    ret
+
 global exit
 exit:
     xor eax, eax
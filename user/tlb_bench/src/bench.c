@@ -0,0 +1,71 @@
+#include <stdint.h>
+
+#define ALLOC_LARGE 0x01
+
+// Big enough that its 4KiB pages don't fit into the TLB, but only a handful of large pages.
+#define REGION_SIZE (16 * 1024 * 1024)
+#define PAGE_SIZE 4096
+#define CACHE_LINE 64
+#define PASSES 16
+
+extern void exit();
+extern void putc(uint32_t c);
+extern void *alloc(uint32_t size, uint32_t flags);
+extern void free(volatile void *addr, uint32_t size);
+
+static void puts(const char *str) {
+    while (*str) putc(0x0f00 | *str++);
+}
+
+static void put_hex(uint64_t value) {
+    puts("0x");
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        putc(0x0f00 | "0123456789abcdef"[(value >> shift) & 0xf]);
+    }
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+// Touches one word on every page, so nearly every access needs a new TLB entry
+// if the region is made of normal pages. Moving one cache line further each time
+// keeps all the accesses from fighting over the same cache set.
+static uint64_t sweep(volatile uint32_t *region) {
+    uint64_t start = rdtsc();
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        for (uint32_t offset = 0; offset < REGION_SIZE; offset += PAGE_SIZE + CACHE_LINE) {
+            region[offset / sizeof(uint32_t)] += pass;
+        }
+    }
+
+    return rdtsc() - start;
+}
+
+static void bench(const char *name, uint32_t flags) {
+    volatile uint32_t *region = alloc(REGION_SIZE, flags);
+    puts(name);
+    if (region == 0) {
+        puts("alloc failed\n");
+        return;
+    }
+
+    sweep(region); // warm up the caches, so only the TLB makes a difference
+    put_hex(sweep(region));
+    puts(" cycles\n");
+
+    // The next run wants the memory for itself, large pages especially.
+    free(region, REGION_SIZE);
+}
+
+void _start() {
+    bench("4KiB pages:  ", 0);
+    bench("large pages: ", ALLOC_LARGE);
+
+    exit();
+
+    while (1);
+}
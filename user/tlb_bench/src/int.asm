@@ -0,0 +1,56 @@
+section .text
+global putc
+putc:
+    push ebp
+    mov ebp, esp
+    push ebx
+
+    mov ebx, dword [ebp + 8]
+    mov eax, 1
+    int 0x69
+
+    pop ebx
+    leave
+    ret
+
+global alloc
+alloc:
+    push ebp
+    mov ebp, esp
+    push ebx
+
+    mov ebx, dword [ebp + 8]
+    mov ecx, dword [ebp + 12]
+    mov eax, 3
+    int 0x69
+
+    pop ebx
+    leave
+    ret
+
+global free
+free:
+    push ebp
+    mov ebp, esp
+    push ebx
+
+    mov ebx, dword [ebp + 8]
+    mov ecx, dword [ebp + 12]
+    mov eax, 10
+    int 0x69
+
+    pop ebx
+    leave
+    ret
+
+global exit
+exit:
+    xor eax, eax
+    int 0x69
+
+.scream:
+    mov ebx, 0xc000 | 'A'
+    inc eax
+    int 0x60
+
+    jmp .scream
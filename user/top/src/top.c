@@ -0,0 +1,127 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Prints what every process has been doing, SAMPLES times, INTERVAL_MS apart. The console
+// is everyone's, so it stops after that instead of scrolling forever.
+#define INTERVAL_MS 1000
+#define SAMPLES 5
+// Processes it remembers between samples, for their share of the CPU since the last one.
+#define MAX_PROCS 64
+
+#define STATE_RUNNING 0
+#define STATE_READY   1
+
+// Has to match proc_stats_t in the kernel's proc.h. All times are in us.
+typedef struct {
+    uint32_t pid;
+    uint32_t state;
+    uint32_t priority;
+    uint32_t cpu;
+    uint64_t run_time;
+    uint64_t ready_time;
+    uint64_t last_run;
+    uint64_t now;
+    uint32_t voluntary_switches;
+    uint32_t involuntary_switches;
+    uint32_t is_kernel_thread;
+    uint32_t max_wake_latency;
+} proc_stats_t;
+
+typedef struct {
+    uint32_t pid;
+    uint64_t run_time;
+    uint64_t now;
+} sample_t;
+
+extern void exit();
+extern void putc(uint32_t c);
+extern void sleep(uint32_t ms);
+// Fills in stats for the live process with the lowest ID that's at least pid. Returns that
+// ID, or -1 if there's none.
+extern uint32_t proc_stats(uint32_t pid, proc_stats_t *stats);
+
+static sample_t last[MAX_PROCS];
+static uint32_t last_count = 0;
+
+static void puts(const char *str) {
+    while (*str) putc(0x0f00 | *str++);
+}
+
+// Right-aligned in width characters.
+static void put_dec(uint64_t value, int width) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    for (int i = count; i < width; i++) putc(0x0f00 | ' ');
+    while (count > 0) putc(0x0f00 | digits[--count]);
+}
+
+static sample_t *find_last(uint32_t pid) {
+    for (uint32_t i = 0; i < last_count; i++) {
+        if (last[i].pid == pid) return &last[i];
+    }
+
+    return NULL;
+}
+
+static void print_proc(proc_stats_t *stats) {
+    put_dec(stats->pid, 5);
+    puts(stats->is_kernel_thread ? " k " : "   ");
+    puts(stats->state == STATE_RUNNING ? "run  " : stats->state == STATE_READY ? "ready" : "wait ");
+    put_dec(stats->priority, 5);
+    put_dec(stats->cpu, 4);
+
+    // Since the last sample. Processes that are new since then, maybe with the ID of one that
+    // exited, don't have a share yet.
+    sample_t *prev = find_last(stats->pid);
+    if (prev != NULL && stats->run_time < prev->run_time) prev = NULL;
+    uint64_t elapsed = prev != NULL ? stats->now - prev->now : 0;
+    if (elapsed != 0) {
+        uint64_t run = stats->run_time - prev->run_time;
+        put_dec(run * 100 / elapsed, 5);
+        putc(0x0f00 | '%');
+    } else {
+        puts("     -");
+    }
+
+    put_dec(stats->run_time / 1000, 9);
+    put_dec(stats->ready_time / 1000, 9);
+    put_dec(stats->voluntary_switches, 7);
+    put_dec(stats->involuntary_switches, 7);
+    put_dec(stats->max_wake_latency, 9);
+    putc(0x0f00 | '\n');
+}
+
+static void sample() {
+    sample_t now[MAX_PROCS];
+    uint32_t count = 0;
+
+    puts("  PID   STATE PRIO CPU  %CPU   RUN ms READY ms    VOL  INVOL  WAKE us\n");
+
+    proc_stats_t stats;
+    for (uint32_t pid = proc_stats(0, &stats); pid != (uint32_t) -1; pid = proc_stats(pid + 1, &stats)) {
+        print_proc(&stats);
+
+        if (count < MAX_PROCS) {
+            now[count++] = (sample_t) { stats.pid, stats.run_time, stats.now };
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++) last[i] = now[i];
+    last_count = count;
+}
+
+void _start() {
+    for (int i = 0; i < SAMPLES; i++) {
+        sample();
+        sleep(INTERVAL_MS);
+    }
+
+    exit();
+
+    while (1);
+}